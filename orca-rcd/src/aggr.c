@@ -0,0 +1,352 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <errno.h>
+#include "rcd.h"
+
+/*
+ * Aggregation of txs events into per-station, per-rate attempt/success
+ * counters. Each PHY has one aggregator per summary interval that is in use,
+ * shared by all its users (clients or MQTT). At the end of every interval,
+ * each station that transmitted is reported with one txs_summary line:
+ *
+ *   <phy>;<ts>;txs_summary;<macaddr>;<interval>;<frames>;<acked>;<rate>,<attempts>,<success>;...
+ *
+ * Accounting follows minstrel: every rate of the MRR chain is charged with
+ * count * num_frames attempts, and the acked frames are credited to the last
+ * rate that was used.
+ */
+#define AGGR_MRR_MAX	4
+
+struct aggr_rate {
+	uint16_t rate;
+	uint32_t attempts;
+	uint32_t success;
+};
+
+struct aggr_sta {
+	struct mac_entry node;
+	uint64_t ts;
+	uint32_t frames;
+	uint32_t acked;
+	bool active;
+	unsigned int n_rates;
+	unsigned int size;
+	struct aggr_rate *rates;
+};
+
+struct txs_aggr {
+	struct list_head list;
+	struct list_head users;
+	struct phy *phy;
+	unsigned int interval_ms;
+	struct uloop_timeout timeout;
+	struct mac_table stations;
+};
+
+static void
+aggr_sta_free(struct mac_entry *e)
+{
+	struct aggr_sta *sta = container_of(e, struct aggr_sta, node);
+
+	free(sta->rates);
+	free(sta);
+}
+
+static struct aggr_sta *
+aggr_sta_get(struct txs_aggr *aggr, const uint8_t *addr)
+{
+	struct aggr_sta *sta;
+	struct mac_entry *e;
+
+	e = mac_table_get(&aggr->stations, addr);
+	if (e)
+		return container_of(e, struct aggr_sta, node);
+
+	sta = calloc(1, sizeof(*sta));
+	if (!sta)
+		return NULL;
+
+	memcpy(sta->node.addr, addr, sizeof(sta->node.addr));
+	if (mac_table_add(&aggr->stations, &sta->node)) {
+		free(sta);
+		return NULL;
+	}
+
+	return sta;
+}
+
+static struct aggr_rate *
+aggr_rate_get(struct aggr_sta *sta, uint16_t rate)
+{
+	struct aggr_rate *r;
+	unsigned int i;
+
+	for (i = 0; i < sta->n_rates; i++)
+		if (sta->rates[i].rate == rate)
+			return &sta->rates[i];
+
+	if (sta->n_rates == sta->size) {
+		r = realloc(sta->rates, (sta->size + 8) * sizeof(*r));
+		if (!r)
+			return NULL;
+
+		sta->rates = r;
+		sta->size += 8;
+	}
+
+	r = &sta->rates[sta->n_rates++];
+	memset(r, 0, sizeof(*r));
+	r->rate = rate;
+
+	return r;
+}
+
+/* parse a hex field and move str to the start of the next one */
+static unsigned long
+aggr_field(const char **str, char sep, bool *valid)
+{
+	unsigned long val;
+	char *end;
+
+	val = strtoul(*str, &end, 16);
+	*valid = end != *str;
+	if (*end == sep)
+		end++;
+	else if (*end && *end != ';')
+		*valid = false;
+
+	*str = end;
+	return val;
+}
+
+/* txs;<macaddr>;<num_frames>;<num_acked>;<probe>;<rate>,<count>,<txpwr>;... */
+static void
+aggr_txs(struct txs_aggr *aggr, const struct rcd_event *ev, uint64_t ts,
+	 unsigned long frames, unsigned long acked, const char *mrr)
+{
+	struct aggr_rate *r, *last = NULL;
+	struct aggr_sta *sta;
+	unsigned long rate, count;
+	unsigned int i;
+	bool valid;
+
+	sta = aggr_sta_get(aggr, ev->addr);
+	if (!sta)
+		return;
+
+	for (i = 0; i < AGGR_MRR_MAX && *mrr; i++) {
+		rate = aggr_field(&mrr, ',', &valid);
+		if (!valid || rate > UINT16_MAX)
+			break;
+
+		count = aggr_field(&mrr, ',', &valid);
+		if (!valid)
+			break;
+
+		/* skip txpwr */
+		mrr += strcspn(mrr, ";");
+		if (*mrr == ';')
+			mrr++;
+
+		r = aggr_rate_get(sta, rate);
+		if (!r)
+			break;
+
+		r->attempts += count * frames;
+		last = r;
+	}
+
+	if (last)
+		last->success += acked;
+
+	sta->frames += frames;
+	sta->acked += acked;
+	sta->ts = ts;
+	sta->active = true;
+}
+
+void txs_aggr_event(struct phy *phy, const struct rcd_event *ev)
+{
+	unsigned long frames, acked;
+	struct txs_aggr *aggr;
+	const char *cur;
+	uint64_t ts;
+	bool valid;
+
+	if (!ev->has_mac)
+		return;
+
+	ts = strtoull(ev->str, NULL, 16);
+
+	/* skip "<ts>;txs;<macaddr>;" */
+	cur = strchr(ev->str, ';') + strlen(";txs;") + 17;
+	if (*cur++ != ';')
+		return;
+
+	frames = aggr_field(&cur, ';', &valid);
+	if (!valid)
+		return;
+
+	acked = aggr_field(&cur, ';', &valid);
+	if (!valid)
+		return;
+
+	/* probe flag */
+	aggr_field(&cur, ';', &valid);
+	if (!valid)
+		return;
+
+	list_for_each_entry(aggr, &phy->txs_aggrs, list)
+		aggr_txs(aggr, ev, ts, frames, acked, cur);
+}
+
+static struct rcd_line *
+aggr_sta_line(struct txs_aggr *aggr, struct aggr_sta *sta)
+{
+	const char *name = phy_name(aggr->phy);
+	struct rcd_line *line;
+	unsigned int i;
+	size_t size;
+	char *out;
+	int len;
+
+	/* each of ";rate,attempts,success" takes at most 4 + 1 + 8 + 1 + 8 + 1 */
+	size = strlen(name) + 96 + sta->n_rates * 23;
+	line = rcd_line_alloc(size);
+	if (!line)
+		return NULL;
+
+	out = line->data;
+	len = snprintf(out, size + 1, "%s;%llx;txs_summary;" MAC_FMT ";%x;%x;%x", name,
+		       (unsigned long long) sta->ts, MAC_ARG(sta->node.addr),
+		       aggr->interval_ms, sta->frames, sta->acked);
+	out += len;
+
+	for (i = 0; i < sta->n_rates; i++) {
+		if (!sta->rates[i].attempts)
+			continue;
+
+		out += sprintf(out, ";%x,%x,%x", sta->rates[i].rate,
+			       sta->rates[i].attempts, sta->rates[i].success);
+	}
+
+	*out++ = '\n';
+	*out = 0;
+	line->len = out - line->data;
+
+	return line;
+}
+
+static void
+aggr_emit(struct txs_aggr *aggr, struct rcd_line *line)
+{
+	struct txs_aggr_user *u, *tmp;
+
+	list_for_each_entry_safe(u, tmp, &aggr->users, list)
+		u->cb(u, line);
+}
+
+static void
+aggr_flush(struct uloop_timeout *t)
+{
+	struct txs_aggr *aggr = container_of(t, struct txs_aggr, timeout);
+	struct mac_entry *e, *next;
+	struct aggr_sta *sta;
+	struct rcd_line *line;
+	unsigned int i;
+
+	uloop_timeout_set(t, aggr->interval_ms);
+
+	mac_table_for_each_safe(&aggr->stations, e, next, i) {
+		sta = container_of(e, struct aggr_sta, node);
+
+		/* forget stations that did not transmit for a whole interval */
+		if (!sta->active) {
+			mac_table_del(&aggr->stations, e);
+			aggr_sta_free(e);
+			continue;
+		}
+
+		line = aggr_sta_line(aggr, sta);
+		if (line) {
+			aggr_emit(aggr, line);
+			rcd_line_put(line);
+		}
+
+		sta->n_rates = 0;
+		sta->frames = sta->acked = 0;
+		sta->active = false;
+	}
+}
+
+int txs_aggr_attach(struct phy *phy, struct txs_aggr_user *u, unsigned int interval_ms)
+{
+	struct txs_aggr *aggr;
+
+	list_for_each_entry(aggr, &phy->txs_aggrs, list)
+		if (aggr->interval_ms == interval_ms)
+			goto found;
+
+	aggr = calloc(1, sizeof(*aggr));
+	if (!aggr)
+		return ENOMEM;
+
+	aggr->phy = phy;
+	aggr->interval_ms = interval_ms;
+	aggr->timeout.cb = aggr_flush;
+	INIT_LIST_HEAD(&aggr->users);
+	list_add_tail(&aggr->list, &phy->txs_aggrs);
+	uloop_timeout_set(&aggr->timeout, interval_ms);
+
+found:
+	u->aggr = aggr;
+	list_add_tail(&u->list, &aggr->users);
+
+	return 0;
+}
+
+static void
+aggr_free(struct txs_aggr *aggr)
+{
+	uloop_timeout_cancel(&aggr->timeout);
+	mac_table_flush(&aggr->stations, aggr_sta_free);
+	list_del(&aggr->list);
+	free(aggr);
+}
+
+void txs_aggr_detach(struct txs_aggr_user *u)
+{
+	struct txs_aggr *aggr = u->aggr;
+
+	if (!aggr)
+		return;
+
+	list_del(&u->list);
+	u->aggr = NULL;
+
+	if (list_empty(&aggr->users))
+		aggr_free(aggr);
+}
+
+struct phy *txs_aggr_phy(struct txs_aggr_user *u)
+{
+	return u->aggr ? u->aggr->phy : NULL;
+}
+
+/* the PHY is going away, its users are notified with a NULL line */
+void txs_aggr_phy_free(struct phy *phy)
+{
+	struct txs_aggr *aggr, *tmp;
+	struct txs_aggr_user *u, *utmp;
+
+	list_for_each_entry_safe(aggr, tmp, &phy->txs_aggrs, list) {
+		list_for_each_entry_safe(u, utmp, &aggr->users, list) {
+			list_del(&u->list);
+			u->aggr = NULL;
+			u->cb(u, NULL);
+		}
+
+		aggr_free(aggr);
+	}
+}
@@ -0,0 +1,847 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+/*
+ * End-to-end benchmark for orca-rcd.
+ *
+ * A fake debugfs/sysfs tree with one FIFO as api_event per PHY is created in
+ * a temporary directory (on tmpfs if available) and orca-rcd is started on
+ * it. The benchmark then writes txs/rxs/stats lines into the FIFOs at a fixed
+ * rate while plain, zstd and binary protocol clients are attached to the
+ * daemon. Each line
+ * carries its CLOCK_MONOTONIC send time as API timestamp, which allows the
+ * clients to measure the forwarding latency.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#define RCD_PORT		0x5243
+#define BENCH_TICK_NS		1000000ULL
+#define BENCH_PIPE_SIZE		(1 << 20)
+#define BENCH_BUF_SIZE		(1 << 16)
+
+/* binary protocol message types, see binary.c */
+#define BIN_MSG_TEXT		0
+#define BIN_MSG_TXS		3
+#define BIN_MSG_RXS		4
+
+enum bench_client_kind {
+	CLIENT_PLAIN,
+	CLIENT_ZSTD,
+	CLIENT_BINARY,
+	__CLIENT_KIND_MAX
+};
+
+struct bench_phy {
+	char name[16];
+	int fd;
+	uint64_t sent;
+	size_t pos;
+	char buf[BENCH_BUF_SIZE];
+};
+
+struct bench_samples {
+	uint32_t *val;
+	size_t len;
+	size_t size;
+};
+
+struct bench_client {
+	int fd;
+	enum bench_client_kind kind;
+	bool probe;
+	uint64_t wire_bytes;
+	uint64_t bytes;
+	uint64_t lines;
+	size_t pos;
+	char buf[BENCH_BUF_SIZE];
+	/* last timestamp per PHY id on binary connections */
+	uint64_t bin_ts[256];
+#ifdef CONFIG_ZSTD
+	ZSTD_DCtx *dctx;
+#endif
+};
+
+static const char *daemon_path = "./orca-rcd";
+static const char *dict_path = "/lib/orca-rcd/dictionary.zdict";
+static unsigned int n_phys = 1, n_stations = 8, rate = 1000;
+static unsigned int n_plain = 1, n_zstd = 0, n_binary = 0;
+static unsigned int duration = 10, warmup = 1;
+
+static struct bench_phy *phys;
+static struct bench_client *clients;
+static unsigned int n_clients;
+static struct bench_samples samples[__CLIENT_KIND_MAX];
+static uint64_t measure_start;
+static char root[PATH_MAX];
+static pid_t daemon_pid;
+static uint32_t rng = 0x2545f491;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t
+bench_rand(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: orca-rcd-bench [-x ORCA_RCD] [-p PHYS] [-m STATIONS] [-r RATE]"
+			" [-n PLAIN_CLIENTS] [-z ZSTD_CLIENTS] [-b BINARY_CLIENTS] [-t SECONDS] [-w WARMUP]"
+			" [-D DICT] [-- ORCA_RCD_ARGS...]\n"
+			"	ORCA_RCD is the daemon binary to benchmark (default ./orca-rcd)\n"
+			"	RATE is the number of events per second and PHY (default 1000)\n"
+			"	SECONDS is the measurement duration after WARMUP seconds (default 10, 1)\n"
+			"	DICT is the zstd dictionary used by the daemon (default /lib/orca-rcd/dictionary.zdict)\n"
+			"	Remaining arguments are passed to orca-rcd.\n");
+}
+
+static int
+write_file(const char *path, const char *data)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+
+	fputs(data, f);
+	fclose(f);
+	return 0;
+}
+
+static int
+tree_setup(void)
+{
+	char path[PATH_MAX + 64], api_phy[256];
+	unsigned int i;
+	int len;
+
+	if (!access("/dev/shm", W_OK))
+		snprintf(root, sizeof(root), "/dev/shm/orca-rcd-bench.XXXXXX");
+	else
+		snprintf(root, sizeof(root), "/tmp/orca-rcd-bench.XXXXXX");
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/sys", root);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/debug", root);
+	mkdir(path, 0755);
+
+	for (i = 0; i < n_phys; i++) {
+		struct bench_phy *p = &phys[i];
+
+		snprintf(p->name, sizeof(p->name), "phy%u", i);
+
+		snprintf(path, sizeof(path), "%s/sys/%s", root, p->name);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/debug/%s", root, p->name);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/debug/%s/rc", root, p->name);
+		mkdir(path, 0755);
+
+		snprintf(path, sizeof(path), "%s/debug/%s/rc/api_info", root, p->name);
+		write_file(path, "#start;iface;txs,rxs,stats\n#stop;iface\n");
+
+		len = snprintf(api_phy, sizeof(api_phy), "drv;bench\ntpc;pkt;1;0,20,e0,2\n"
+			       "ftrs;1;tpc,0\npwr_limit;2e\nif;%s-ap0;txs,rxs\n", p->name);
+		snprintf(api_phy + len, sizeof(api_phy) - len, "sta;02:00:00:%02x:00:00;3c;18;ff\n", i);
+		snprintf(path, sizeof(path), "%s/debug/%s/rc/api_phy", root, p->name);
+		write_file(path, api_phy);
+
+		snprintf(path, sizeof(path), "%s/debug/%s/rc/api_control", root, p->name);
+		write_file(path, "");
+
+		snprintf(path, sizeof(path), "%s/debug/%s/rc/api_event", root, p->name);
+		if (mkfifo(path, 0644)) {
+			perror("mkfifo");
+			return -1;
+		}
+
+		/* keep both ends open, so neither side blocks on open or sees EOF */
+		p->fd = open(path, O_RDWR | O_NONBLOCK);
+		if (p->fd < 0) {
+			perror(path);
+			return -1;
+		}
+		fcntl(p->fd, F_SETPIPE_SZ, BENCH_PIPE_SIZE);
+	}
+
+	return 0;
+}
+
+static void
+tree_cleanup(void)
+{
+	char cmd[PATH_MAX + 16];
+
+	if (!root[0])
+		return;
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+	if (system(cmd))
+		fprintf(stderr, "failed to remove %s\n", root);
+}
+
+static int
+daemon_start(char **extra_args, int n_extra)
+{
+	char debugfs[PATH_MAX + 8], sysfs[PATH_MAX + 8];
+	char **argv;
+	int i, n = 0;
+
+	snprintf(debugfs, sizeof(debugfs), "%s/debug", root);
+	snprintf(sysfs, sizeof(sysfs), "%s/sys", root);
+
+	argv = calloc(n_extra + 10, sizeof(*argv));
+	argv[n++] = (char *) daemon_path;
+	argv[n++] = "-h";
+	argv[n++] = "127.0.0.1";
+	argv[n++] = "-d";
+	argv[n++] = debugfs;
+	argv[n++] = "-S";
+	argv[n++] = sysfs;
+	for (i = 0; i < n_extra; i++)
+		argv[n++] = extra_args[i];
+
+	daemon_pid = fork();
+	if (daemon_pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!daemon_pid) {
+		int null = open("/dev/null", O_WRONLY);
+
+		dup2(null, STDOUT_FILENO);
+		execv(daemon_path, argv);
+		perror(daemon_path);
+		_exit(1);
+	}
+
+	free(argv);
+	return 0;
+}
+
+static uint64_t
+daemon_cpu_ns(void)
+{
+	char path[64];
+	unsigned long long ns;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/schedstat", daemon_pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%llu", &ns) != 1)
+		ns = 0;
+
+	fclose(f);
+	return ns;
+}
+
+static int
+client_connect(struct bench_client *cl, int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int i;
+
+	for (i = 0; i < 50; i++) {
+		cl->fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (cl->fd < 0)
+			return -1;
+
+		if (!connect(cl->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			fcntl(cl->fd, F_SETFL, O_NONBLOCK);
+			return 0;
+		}
+
+		close(cl->fd);
+		usleep(100000);
+	}
+
+	fprintf(stderr, "failed to connect to orca-rcd on port %d\n", port);
+	return -1;
+}
+
+static void
+samples_add(struct bench_samples *s, uint64_t val)
+{
+	if (s->len == s->size) {
+		s->size = s->size ? s->size * 2 : 65536;
+		s->val = realloc(s->val, s->size * sizeof(*s->val));
+		if (!s->val) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	s->val[s->len++] = val > UINT32_MAX ? UINT32_MAX : val;
+}
+
+static int
+samples_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+samples_pct(struct bench_samples *s, double pct)
+{
+	size_t idx;
+
+	if (!s->len)
+		return 0;
+
+	idx = (size_t) (pct / 100.0 * (s->len - 1) + 0.5);
+	return s->val[idx];
+}
+
+static void
+client_event(struct bench_client *cl, uint64_t ts, uint64_t now)
+{
+	if (ts < measure_start)
+		return;
+
+	cl->lines++;
+	if (cl->probe)
+		samples_add(&samples[cl->kind], (now - ts) / 1000);
+}
+
+static void
+client_line(struct bench_client *cl, char *line, uint64_t now)
+{
+	char *sep, *end;
+	uint64_t ts;
+
+	sep = strchr(line, ';');
+	if (!sep || *line == '*')
+		return;
+
+	ts = strtoull(sep + 1, &end, 16);
+	if (!ts || *end != ';')
+		return;
+
+	client_event(cl, ts, now);
+}
+
+/* returns false if the varint is incomplete */
+static bool
+bin_varint(const uint8_t **cur, const uint8_t *end, uint64_t *val)
+{
+	int shift;
+
+	*val = 0;
+	for (shift = 0; *cur < end && shift < 64; shift += 7) {
+		*val |= (uint64_t) (**cur & 0x7f) << shift;
+		if (!(*(*cur)++ & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+static void
+client_frame(struct bench_client *cl, const uint8_t *data, size_t len, uint64_t now)
+{
+	static char line[BENCH_BUF_SIZE];
+	const uint8_t *cur = data + 1, *end = data + len;
+	uint64_t id, delta;
+
+	switch (data[0]) {
+	case BIN_MSG_TEXT:
+		memcpy(line, cur, len - 1);
+		line[len - 1] = 0;
+		client_line(cl, line, now);
+		break;
+	case BIN_MSG_TXS:
+	case BIN_MSG_RXS:
+		if (!bin_varint(&cur, end, &id) || !bin_varint(&cur, end, &delta) ||
+		    id >= 256)
+			break;
+
+		cl->bin_ts[id] += (delta >> 1) ^ -(delta & 1);
+		client_event(cl, cl->bin_ts[id], now);
+		break;
+	}
+}
+
+static void
+client_bin_data(struct bench_client *cl, const char *data, size_t len, uint64_t now)
+{
+	const uint8_t *cur, *end, *frame;
+	uint64_t flen;
+	size_t n;
+
+	if (now >= measure_start)
+		cl->bytes += len;
+
+	while (len) {
+		n = sizeof(cl->buf) - cl->pos;
+		if (n > len)
+			n = len;
+
+		memcpy(cl->buf + cl->pos, data, n);
+		cl->pos += n;
+		data += n;
+		len -= n;
+
+		cur = (const uint8_t *) cl->buf;
+		end = cur + cl->pos;
+		while (cur < end) {
+			/* keep incomplete frames for the next read */
+			frame = cur;
+			if (!bin_varint(&cur, end, &flen) || flen > (uint64_t) (end - cur)) {
+				cur = frame;
+				break;
+			}
+
+			if (flen)
+				client_frame(cl, cur, flen, now);
+			cur += flen;
+		}
+
+		cl->pos = end - cur;
+		if (cl->pos == sizeof(cl->buf))
+			cl->pos = 0;
+		memmove(cl->buf, cur, cl->pos);
+	}
+}
+
+static void
+client_data(struct bench_client *cl, const char *data, size_t len, uint64_t now)
+{
+	char *cur, *nl;
+
+	if (now >= measure_start)
+		cl->bytes += len;
+
+	while (len) {
+		size_t n = sizeof(cl->buf) - 1 - cl->pos;
+
+		if (n > len)
+			n = len;
+
+		memcpy(cl->buf + cl->pos, data, n);
+		cl->pos += n;
+		cl->buf[cl->pos] = 0;
+		data += n;
+		len -= n;
+
+		for (cur = cl->buf; (nl = strchr(cur, '\n')); cur = nl + 1) {
+			*nl = 0;
+			client_line(cl, cur, now);
+		}
+
+		cl->pos = strlen(cur);
+		if (cl->pos == sizeof(cl->buf) - 1)
+			cl->pos = 0;
+		memmove(cl->buf, cur, cl->pos);
+	}
+}
+
+static int
+client_read(struct bench_client *cl)
+{
+	static char buf[BENCH_BUF_SIZE];
+	uint64_t now;
+	ssize_t len;
+
+	while (1) {
+		len = read(cl->fd, buf, sizeof(buf));
+		if (len < 0)
+			return errno == EAGAIN ? 0 : -1;
+
+		if (!len)
+			return -1;
+
+		now = now_ns();
+		if (now >= measure_start)
+			cl->wire_bytes += len;
+
+		if (cl->kind == CLIENT_PLAIN) {
+			client_data(cl, buf, len, now);
+			continue;
+		}
+
+		if (cl->kind == CLIENT_BINARY) {
+			client_bin_data(cl, buf, len, now);
+			continue;
+		}
+
+#ifdef CONFIG_ZSTD
+		{
+			static char out[BENCH_BUF_SIZE];
+			ZSTD_inBuffer in = { buf, len, 0 };
+			size_t ret;
+
+			while (in.pos < in.size) {
+				ZSTD_outBuffer o = { out, sizeof(out), 0 };
+
+				ret = ZSTD_decompressStream(cl->dctx, &o, &in);
+				if (ZSTD_isError(ret)) {
+					fprintf(stderr, "decompression failed: %s\n",
+						ZSTD_getErrorName(ret));
+					return -1;
+				}
+
+				client_data(cl, out, o.pos, now);
+			}
+		}
+#endif
+	}
+}
+
+static void
+phy_generate(struct bench_phy *p, unsigned int idx, uint64_t now, uint64_t start)
+{
+	uint64_t due = (double) rate * (now - start) / 1e9;
+	unsigned int sta;
+	uint32_t r;
+	ssize_t len;
+	int n;
+
+	while (p->sent < due) {
+		r = bench_rand();
+		sta = r % n_stations;
+
+		if (r % 100 < 80)
+			n = snprintf(p->buf + p->pos, sizeof(p->buf) - p->pos,
+				     "%llx;txs;02:00:00:%02x:00:%02x;%x;%x;0;%x,%x,1f;%x,1,21;,,;,,\n",
+				     (unsigned long long) now, idx, sta, 1 + (r >> 8) % 4, (r >> 12) % 2,
+				     0x260 + (r >> 16) % 32, 1 + (r >> 24) % 3, 0x250 + (r >> 16) % 32);
+		else if (r % 100 < 95)
+			n = snprintf(p->buf + p->pos, sizeof(p->buf) - p->pos,
+				     "%llx;rxs;02:00:00:%02x:00:%02x;%d;%d,%d,,\n",
+				     (unsigned long long) now, idx, sta, -40 - (int) ((r >> 8) % 40),
+				     -42 - (int) ((r >> 16) % 40), -44 - (int) ((r >> 24) % 40));
+		else
+			n = snprintf(p->buf + p->pos, sizeof(p->buf) - p->pos,
+				     "%llx;stats;02:00:00:%02x:00:%02x;%x;%x;%x;%x;%x\n",
+				     (unsigned long long) now, idx, sta, 0x260 + (r >> 8) % 32,
+				     (r >> 13) % 1000, (r >> 23) % 0x100, (r >> 10) % 0x400,
+				     (r >> 20) % 0x400);
+
+		if (n >= (int) (sizeof(p->buf) - p->pos))
+			break;
+
+		p->pos += n;
+		p->sent++;
+	}
+
+	if (!p->pos)
+		return;
+
+	len = write(p->fd, p->buf, p->pos);
+	if (len <= 0)
+		return;
+
+	p->pos -= len;
+	memmove(p->buf, p->buf + len, p->pos);
+}
+
+static void
+report(uint64_t elapsed, uint64_t cpu, uint64_t sent)
+{
+	static const char *kind[__CLIENT_KIND_MAX] = { "plain", "zstd", "bin" };
+	uint64_t bytes[__CLIENT_KIND_MAX] = {}, wire[__CLIENT_KIND_MAX] = {};
+	uint64_t lines[__CLIENT_KIND_MAX] = {}, min_lines = UINT64_MAX;
+	unsigned int i, n[__CLIENT_KIND_MAX] = {};
+	double secs = elapsed / 1e9;
+
+	for (i = 0; i < n_clients; i++) {
+		struct bench_client *cl = &clients[i];
+
+		bytes[cl->kind] += cl->bytes;
+		wire[cl->kind] += cl->wire_bytes;
+		lines[cl->kind] += cl->lines;
+		n[cl->kind]++;
+		if (cl->lines < min_lines)
+			min_lines = cl->lines;
+	}
+
+	printf("phys %u, stations %u, offered %u events/s per PHY, %u plain + %u zstd + %u binary clients, %.1fs\n",
+	       n_phys, n_stations, rate, n_plain, n_zstd, n_binary, secs);
+	printf("events sent:          %llu (%.0f/s)\n", (unsigned long long) sent, sent / secs);
+	printf("events forwarded:     %llu per client (%.0f/s sustained)\n",
+	       (unsigned long long) min_lines, min_lines / secs);
+	printf("daemon cpu:           %.3fs (%.1f%%), %.2f us/event\n", cpu / 1e9,
+	       100.0 * cpu / elapsed, sent ? cpu / 1e3 / sent : 0);
+
+	for (i = 0; i < __CLIENT_KIND_MAX; i++) {
+		struct bench_samples *s = &samples[i];
+
+		if (!n[i])
+			continue;
+
+		qsort(s->val, s->len, sizeof(*s->val), samples_cmp);
+		printf("%-5s latency (us):   p50 %.0f  p99 %.0f  p999 %.0f  max %.0f  (%zu samples)\n",
+		       kind[i], samples_pct(s, 50), samples_pct(s, 99), samples_pct(s, 99.9),
+		       samples_pct(s, 100), s->len);
+		printf("%-5s bytes/client:   wire %llu (%.1f/event), payload %llu, ratio %.2f\n",
+		       kind[i], (unsigned long long) (wire[i] / n[i]),
+		       lines[i] ? (double) wire[i] / lines[i] : 0,
+		       (unsigned long long) (bytes[i] / n[i]),
+		       wire[i] ? (double) bytes[i] / wire[i] : 0);
+	}
+}
+
+#ifdef CONFIG_ZSTD
+static void *
+load_dict(const char *path, size_t *len)
+{
+	struct stat st;
+	void *buf;
+	FILE *f;
+
+	if (stat(path, &st)) {
+		perror(path);
+		return NULL;
+	}
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	buf = malloc(st.st_size);
+	if (buf && fread(buf, 1, st.st_size, f) != (size_t) st.st_size) {
+		free(buf);
+		buf = NULL;
+	}
+
+	fclose(f);
+	*len = st.st_size;
+	return buf;
+}
+#endif
+
+static int
+clients_setup(void)
+{
+	unsigned int i;
+#ifdef CONFIG_ZSTD
+	void *dict = NULL;
+	size_t dict_len = 0;
+
+	if (n_zstd) {
+		dict = load_dict(dict_path, &dict_len);
+		if (!dict)
+			return -1;
+	}
+#else
+	if (n_zstd) {
+		fprintf(stderr, "zstd clients need a build with zstd support\n");
+		return -1;
+	}
+#endif
+
+	n_clients = n_plain + n_zstd + n_binary;
+	clients = calloc(n_clients, sizeof(*clients));
+	if (!clients)
+		return -1;
+
+	for (i = 0; i < n_clients; i++) {
+		struct bench_client *cl = &clients[i];
+
+		if (i < n_plain)
+			cl->kind = CLIENT_PLAIN;
+		else if (i < n_plain + n_zstd)
+			cl->kind = CLIENT_ZSTD;
+		else
+			cl->kind = CLIENT_BINARY;
+		cl->probe = !i || i == n_plain || i == n_plain + n_zstd;
+
+		if (client_connect(cl, RCD_PORT + cl->kind))
+			return -1;
+
+#ifdef CONFIG_ZSTD
+		if (cl->kind == CLIENT_ZSTD) {
+			cl->dctx = ZSTD_createDCtx();
+			ZSTD_DCtx_loadDictionary(cl->dctx, dict, dict_len);
+		}
+#endif
+	}
+
+#ifdef CONFIG_ZSTD
+	free(dict);
+#endif
+	return 0;
+}
+
+static int
+bench_run(void)
+{
+	uint64_t start, end, now, cpu_start = 0, sent_start = 0, sent = 0;
+	struct pollfd *pfd;
+	bool measuring = false;
+	unsigned int i;
+	int ret = 0;
+
+	pfd = calloc(n_clients, sizeof(*pfd));
+	for (i = 0; i < n_clients; i++) {
+		pfd[i].fd = clients[i].fd;
+		pfd[i].events = POLLIN;
+	}
+
+	start = now_ns();
+	measure_start = start + warmup * 1000000000ULL;
+	end = measure_start + duration * 1000000000ULL;
+
+	while ((now = now_ns()) < end) {
+		if (!measuring && now >= measure_start) {
+			measuring = true;
+			cpu_start = daemon_cpu_ns();
+			for (i = 0; i < n_phys; i++)
+				sent_start += phys[i].sent;
+		}
+
+		for (i = 0; i < n_phys; i++)
+			phy_generate(&phys[i], i, now, start);
+
+		if (poll(pfd, n_clients, BENCH_TICK_NS / 1000000) < 0 && errno != EINTR) {
+			perror("poll");
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < n_clients; i++) {
+			if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			if (client_read(&clients[i])) {
+				fprintf(stderr, "client %u lost connection\n", i);
+				ret = -1;
+				goto out;
+			}
+		}
+	}
+
+	for (i = 0; i < n_phys; i++)
+		sent += phys[i].sent;
+
+	report(now - measure_start, daemon_cpu_ns() - cpu_start, sent - sent_start);
+
+out:
+	free(pfd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ch, ret = 1;
+
+	while ((ch = getopt(argc, argv, "x:p:m:r:n:z:b:t:w:D:")) != -1) {
+		switch (ch) {
+		case 'x':
+			daemon_path = optarg;
+			break;
+		case 'p':
+			n_phys = atoi(optarg);
+			break;
+		case 'm':
+			n_stations = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'n':
+			n_plain = atoi(optarg);
+			break;
+		case 'z':
+			n_zstd = atoi(optarg);
+			break;
+		case 'b':
+			n_binary = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 'D':
+			dict_path = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (!n_phys || !n_stations || n_phys > 256 || n_stations > 256 ||
+	    !(n_plain + n_zstd + n_binary)) {
+		usage();
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	phys = calloc(n_phys, sizeof(*phys));
+	if (!phys || tree_setup())
+		goto out;
+
+	if (daemon_start(argv + optind, argc - optind))
+		goto out;
+
+	if (clients_setup())
+		goto out;
+
+	ret = bench_run() ? 1 : 0;
+
+out:
+	if (daemon_pid > 0) {
+		kill(daemon_pid, SIGTERM);
+		waitpid(daemon_pid, NULL, 0);
+	}
+	tree_cleanup();
+	return ret;
+}
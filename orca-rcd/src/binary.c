@@ -0,0 +1,500 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <sys/socket.h>
+#include "rcd.h"
+
+/*
+ * Binary protocol, spoken on RCD_PORT + 2. Every message in either
+ * direction is a frame:
+ *
+ *   <len:varint><type:u8><payload>
+ *
+ * where len counts the type byte and the payload. Varints are LEB128,
+ * signed values are zigzag encoded. PHYs and stations are interned as small
+ * ids that are announced once (BIN_MSG_PHY, BIN_MSG_STA) before they are
+ * used. txs and rxs events are packed as integers, with the timestamp as
+ * delta to the previous event of the same PHY on the connection. Everything
+ * else (the initial state, other events, replies, lines changed by the
+ * client's projections or sampling) is sent as BIN_MSG_TEXT, carrying one
+ * line as on the text port, without newline. Clients send their commands
+ * as BIN_MSG_TEXT frames.
+ */
+#define BIN_MSG_TEXT		0
+#define BIN_MSG_PHY		1	/* <phy_id><name> */
+#define BIN_MSG_STA		2	/* <sta_id><macaddr:6> */
+#define BIN_MSG_TXS		3	/* <phy_id><ts><sta_id><frames><acked><flags>[<scale>](<rate><count><txpwr>)* */
+#define BIN_MSG_RXS		4	/* <phy_id><ts><sta_id><flags>[<scale>]<rssi><n_chains><mask><chain_rssi>* */
+
+#define BIN_FLAG_PROBE		(1 << 0)
+#define BIN_FLAG_SCALE		(1 << 1)
+
+#define BIN_VARINT_MAX		10
+#define BIN_MRR_MAX		4
+#define BIN_CHAINS_MAX		8
+#define BIN_CMD_MAX		4096
+#define BIN_NAME_MAX		64
+
+struct bin_sta {
+	struct mac_entry node;
+	uint32_t id;
+};
+
+static struct mac_table bin_stations;
+static uint32_t bin_sta_next;
+
+static inline size_t
+bin_put_varint(uint8_t *buf, uint64_t val)
+{
+	size_t len = 0;
+
+	while (val >= 0x80) {
+		buf[len++] = val | 0x80;
+		val >>= 7;
+	}
+	buf[len++] = val;
+
+	return len;
+}
+
+static inline uint64_t
+bin_zigzag(int64_t val)
+{
+	return ((uint64_t) val << 1) ^ (uint64_t) (val >> 63);
+}
+
+static void
+bin_sta_free(struct mac_entry *e)
+{
+	free(container_of(e, struct bin_sta, node));
+}
+
+static size_t
+bin_sta_announce(uint8_t *buf, const struct bin_sta *sta)
+{
+	uint8_t payload[1 + BIN_VARINT_MAX + 6];
+	size_t len = 0, hlen;
+
+	payload[len++] = BIN_MSG_STA;
+	len += bin_put_varint(payload + len, sta->id);
+	memcpy(payload + len, sta->node.addr, 6);
+	len += 6;
+
+	hlen = bin_put_varint(buf, len);
+	memcpy(buf + hlen, payload, len);
+
+	return hlen + len;
+}
+
+/* id of the event's station, announcing new ones in bev */
+static bool
+bin_sta_id(struct rcd_bin_event *bev, const uint8_t *addr, uint32_t *id)
+{
+	struct bin_sta *sta;
+	struct mac_entry *e;
+
+	e = mac_table_get(&bin_stations, addr);
+	if (e) {
+		*id = container_of(e, struct bin_sta, node)->id;
+		return true;
+	}
+
+	sta = calloc(1, sizeof(*sta));
+	if (!sta)
+		return false;
+
+	memcpy(sta->node.addr, addr, sizeof(sta->node.addr));
+	sta->id = bin_sta_next++;
+	if (mac_table_add(&bin_stations, &sta->node)) {
+		free(sta);
+		return false;
+	}
+
+	bev->announce_len = bin_sta_announce(bev->announce, sta);
+	*id = sta->id;
+
+	return true;
+}
+
+static inline int
+bin_hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+/* parse a number up to sep or the end of the string and skip past sep */
+static bool
+bin_hex(const char **str, char sep, uint64_t *val)
+{
+	const char *cur = *str;
+	int digit;
+
+	for (*val = 0; (digit = bin_hexval(*cur)) >= 0; cur++)
+		*val = (*val << 4) | digit;
+
+	if (cur == *str || cur - *str > 16 || (*cur != sep && *cur))
+		return false;
+
+	*str = *cur ? cur + 1 : cur;
+	return true;
+}
+
+static bool
+bin_dec(const char **str, char sep, int64_t *val)
+{
+	const char *cur = *str;
+	bool neg = *cur == '-';
+
+	cur += neg;
+	for (*val = 0; *cur >= '0' && *cur <= '9'; cur++)
+		*val = *val * 10 + (*cur - '0');
+
+	if (cur == *str + neg || cur - *str > 18 || (*cur != sep && *cur))
+		return false;
+
+	if (neg)
+		*val = -*val;
+
+	*str = *cur ? cur + 1 : cur;
+	return true;
+}
+
+/* <num_frames>;<num_acked>;<probe>;<rate>,<count>,<txpwr>;... */
+static bool
+bin_encode_txs(struct rcd_bin_event *bev, const char *cur, uint8_t *out)
+{
+	uint64_t frames, acked, probe, rate, count, txpwr;
+	uint8_t *start = out;
+	unsigned int i;
+
+	if (!bin_hex(&cur, ';', &frames) || !bin_hex(&cur, ';', &acked) ||
+	    !bin_hex(&cur, ';', &probe))
+		return false;
+
+	out += bin_put_varint(out, frames);
+	out += bin_put_varint(out, acked);
+	*out++ = (probe ? BIN_FLAG_PROBE : 0) | (bev->scale != 1 ? BIN_FLAG_SCALE : 0);
+	if (bev->scale != 1)
+		out += bin_put_varint(out, bev->scale);
+
+	for (i = 0; i < BIN_MRR_MAX && *cur; i++) {
+		/* the chain ends with the first unused stage */
+		if (!strncmp(cur, ",,", 2))
+			break;
+
+		if (!bin_hex(&cur, ',', &rate) || !bin_hex(&cur, ',', &count) ||
+		    !bin_hex(&cur, ';', &txpwr))
+			return false;
+
+		out += bin_put_varint(out, rate);
+		out += bin_put_varint(out, count);
+		out += bin_put_varint(out, txpwr);
+	}
+
+	/* the remaining stages must be unused as well */
+	while (*cur) {
+		if (strncmp(cur, ",,", 2) || (cur[2] && cur[2] != ';'))
+			return false;
+
+		cur += cur[2] ? 3 : 2;
+	}
+
+	bev->body_len = out - start;
+	return true;
+}
+
+/* <rssi>;<chain rssi>,<chain rssi>,... with empty unused chains */
+static bool
+bin_encode_rxs(struct rcd_bin_event *bev, const char *cur, uint8_t *out)
+{
+	uint8_t *start = out, *hdr;
+	unsigned int n = 0, mask = 0;
+	int64_t val;
+
+	*out++ = bev->scale != 1 ? BIN_FLAG_SCALE : 0;
+	if (bev->scale != 1)
+		out += bin_put_varint(out, bev->scale);
+
+	if (!bin_dec(&cur, ';', &val))
+		return false;
+
+	out += bin_put_varint(out, bin_zigzag(val));
+
+	hdr = out;
+	out += 2;
+	while (*cur) {
+		if (n == BIN_CHAINS_MAX)
+			return false;
+
+		if (*cur == ',') {
+			cur++;
+		} else {
+			if (!bin_dec(&cur, ',', &val))
+				return false;
+
+			out += bin_put_varint(out, bin_zigzag(val));
+			mask |= 1 << n;
+		}
+		n++;
+	}
+
+	/* a trailing separator adds one more empty chain */
+	if (cur[-1] == ',' || cur[-1] == ';')
+		n++;
+
+	if (n > BIN_CHAINS_MAX)
+		return false;
+
+	hdr[0] = n;
+	hdr[1] = mask;
+
+	bev->body_len = out - start;
+	return true;
+}
+
+/*
+ * Pack an event for the binary clients. Events that cannot be packed are
+ * left with type BIN_MSG_TEXT and are sent as text lines.
+ */
+void rcd_bin_event_encode(const struct rcd_event *ev, struct rcd_bin_event *bev)
+{
+	const char *cur;
+	uint32_t id;
+	size_t len;
+	bool ok;
+
+	bev->type = BIN_MSG_TEXT;
+	bev->announce_len = 0;
+	bev->scale = ev->scale;
+
+	if (ev->type == RCD_EV_STA && ev->has_mac) {
+		/* stations are interned again if they come back */
+		cur = strchr(ev->str, ';') + 1 + strlen("sta;");
+		if (!strncmp(cur, "remove;", 7)) {
+			struct mac_entry *e = mac_table_get(&bin_stations, ev->addr);
+
+			if (e) {
+				mac_table_del(&bin_stations, e);
+				bin_sta_free(e);
+			}
+		}
+		return;
+	}
+
+	if ((ev->type != RCD_EV_TXS && ev->type != RCD_EV_RXS) || !ev->has_mac)
+		return;
+
+	/* skip "<ts>;<type>;<macaddr>;" */
+	cur = strchr(ev->str, ';') + 1;
+	cur += strcspn(cur, ";") + 1 + 17;
+	if (*cur++ != ';')
+		return;
+
+	if (!bin_sta_id(bev, ev->addr, &id))
+		return;
+
+	len = bin_put_varint(bev->body, id);
+	if (ev->type == RCD_EV_TXS)
+		ok = bin_encode_txs(bev, cur, bev->body + len);
+	else
+		ok = bin_encode_rxs(bev, cur, bev->body + len);
+	if (!ok)
+		return;
+
+	bev->body_len += len;
+	bev->ts = strtoull(ev->str, NULL, 16);
+	bev->phy_id = ev->phy->id;
+	bev->type = ev->type == RCD_EV_TXS ? BIN_MSG_TXS : BIN_MSG_RXS;
+}
+
+static uint64_t *
+bin_client_ts(struct client *cl, unsigned int phy_id)
+{
+	unsigned int len = cl->bin_ts_len;
+	uint64_t *ts;
+
+	if (phy_id < len)
+		return &cl->bin_ts[phy_id];
+
+	len = phy_id + 8;
+	ts = realloc(cl->bin_ts, len * sizeof(*ts));
+	if (!ts)
+		return NULL;
+
+	memset(ts + cl->bin_ts_len, 0, (len - cl->bin_ts_len) * sizeof(*ts));
+	cl->bin_ts = ts;
+	cl->bin_ts_len = len;
+
+	return &ts[phy_id];
+}
+
+void rcd_bin_event_send(struct client *cl, const struct rcd_bin_event *bev)
+{
+	uint8_t buf[2 * BIN_VARINT_MAX + 1 + RCD_BIN_BODY_MAX], *payload;
+	uint64_t *last;
+	size_t len = 0, hlen;
+
+	last = bin_client_ts(cl, bev->phy_id);
+	if (!last)
+		return;
+
+	/* payload is built after room for the longest length prefix */
+	payload = buf + BIN_VARINT_MAX;
+	payload[len++] = bev->type;
+	len += bin_put_varint(payload + len, bev->phy_id);
+	len += bin_put_varint(payload + len, bin_zigzag(bev->ts - *last));
+	memcpy(payload + len, bev->body, bev->body_len);
+	len += bev->body_len;
+	*last = bev->ts;
+
+	hlen = bin_put_varint(buf, len);
+	memmove(buf + hlen, payload, len);
+	client_write(cl, (char *) buf, hlen + len);
+}
+
+/* send a block of newline terminated lines as text frames */
+int rcd_bin_text(struct client *cl, const char *data, size_t len)
+{
+	const char *end = data + len, *nl;
+	uint8_t *buf, *out;
+	size_t n;
+
+	buf = malloc(len + (len / 2 + 1) * (BIN_VARINT_MAX + 1));
+	if (!buf)
+		return -1;
+
+	for (out = buf; data < end; data = nl + 1) {
+		nl = memchr(data, '\n', end - data);
+		if (!nl)
+			nl = end;
+
+		n = nl - data;
+		out += bin_put_varint(out, n + 1);
+		*out++ = BIN_MSG_TEXT;
+		memcpy(out, data, n);
+		out += n;
+	}
+
+	client_write(cl, (char *) buf, out - buf);
+	free(buf);
+
+	return 0;
+}
+
+int rcd_bin_vprintf(struct client *cl, const char *fmt, va_list va_args)
+{
+	char buf[256], *str = buf;
+	va_list ap;
+	int len;
+
+	va_copy(ap, va_args);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return -1;
+
+	if (len >= (int) sizeof(buf)) {
+		str = malloc(len + 1);
+		if (!str)
+			return -1;
+
+		vsnprintf(str, len + 1, fmt, va_args);
+	}
+
+	len = rcd_bin_text(cl, str, len);
+	if (str != buf)
+		free(str);
+
+	return len;
+}
+
+void rcd_bin_phy_announce(struct client *cl, struct phy *phy)
+{
+	uint8_t buf[2 * BIN_VARINT_MAX + 1 + BIN_NAME_MAX], *payload = buf + BIN_VARINT_MAX;
+	const char *name = phy_name(phy);
+	size_t len = 0, hlen, nlen;
+
+	nlen = strnlen(name, BIN_NAME_MAX);
+	payload[len++] = BIN_MSG_PHY;
+	len += bin_put_varint(payload + len, phy->id);
+	memcpy(payload + len, name, nlen);
+	len += nlen;
+
+	hlen = bin_put_varint(buf, len);
+	memmove(buf + hlen, payload, len);
+	client_write(cl, (char *) buf, hlen + len);
+}
+
+/* announce the interned stations to a new client */
+void rcd_bin_client_start(struct client *cl)
+{
+	uint8_t buf[1 + 2 * BIN_VARINT_MAX + 6];
+	struct mac_entry *e;
+	unsigned int i;
+
+	mac_table_for_each(&bin_stations, e, i)
+		client_write(cl, (char *) buf,
+			     bin_sta_announce(buf, container_of(e, struct bin_sta, node)));
+}
+
+/* forget the interned stations once the last binary client is gone */
+void rcd_bin_reset(void)
+{
+	mac_table_flush(&bin_stations, bin_sta_free);
+	bin_sta_next = 0;
+}
+
+/* returns the number of bytes consumed */
+int rcd_bin_handle_data(struct client *cl, const uint8_t *data, int len)
+{
+	char cmd[BIN_CMD_MAX + 1];
+	int pos = 0, hlen, shift;
+	uint64_t flen;
+
+	while (pos < len) {
+		flen = 0;
+		for (hlen = 0, shift = 0; pos + hlen < len; hlen++, shift += 7) {
+			if (hlen == BIN_VARINT_MAX)
+				goto error;
+
+			flen |= (uint64_t) (data[pos + hlen] & 0x7f) << shift;
+			if (!(data[pos + hlen] & 0x80))
+				break;
+		}
+
+		/* incomplete length */
+		if (pos + hlen >= len)
+			return pos;
+
+		if (!flen || flen > BIN_CMD_MAX + 1)
+			goto error;
+
+		/* incomplete frame */
+		if (flen > (uint64_t) (len - pos - hlen - 1))
+			return pos;
+
+		pos += hlen + 1;
+		if (data[pos] == BIN_MSG_TEXT && flen > 1) {
+			memcpy(cmd, data + pos + 1, flen - 1);
+			cmd[flen - 1] = 0;
+			cmd[strcspn(cmd, "\r\n")] = 0;
+			if (*cmd)
+				rcd_phy_control(cl, cmd);
+		}
+		pos += flen;
+	}
+
+	return pos;
+
+error:
+	/* the stream cannot be resynchronized, let the client go */
+	shutdown(cl->sfd.fd.fd, SHUT_RDWR);
+	return len;
+}
@@ -9,12 +9,30 @@
 
 static LIST_HEAD(clients);
 static LIST_HEAD(zclients);
+static LIST_HEAD(bclients);
+
+#ifdef CONFIG_ZSTD
+/*
+ * Output for a single compressed client is sent as a frame of its own, which
+ * in streaming mode requires the frame of the stream it receives to be ended
+ * first. Clients waiting to join the shared stream are not in any frame.
+ */
+void client_zstd_private(struct client *cl)
+{
+	if (!cl->compression || cl->zstd_wait)
+		return;
+
+	if (!zstd_buf_at_frame_start(cl->zbuf))
+		zstd_buf_flush(cl->zbuf);
+}
+#endif
 
 int client_vprintf_compressed(struct client *cl, const char *fmt, va_list va_args) {
 	void *compressed;
 	size_t clen;
 	int error;
 
+	client_zstd_private(cl);
 	error = zstd_fmt_compress_va(&compressed, &clen, fmt, va_args);
 	if (error)
 		return error;
@@ -24,13 +42,43 @@ int client_vprintf_compressed(struct client *cl, const char *fmt, va_list va_arg
 	return 0;
 }
 
+static int
+client_vprintf_plain(struct client *cl, const char *fmt, va_list va_args)
+{
+	char buf[256], *str = buf;
+	va_list ap;
+	int len;
+
+	va_copy(ap, va_args);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return -1;
+
+	if (len >= (int) sizeof(buf)) {
+		str = malloc(len + 1);
+		if (!str)
+			return -1;
+
+		vsnprintf(str, len + 1, fmt, va_args);
+	}
+
+	client_write(cl, str, len);
+	if (str != buf)
+		free(str);
+
+	return 0;
+}
+
 int client_vprintf(struct client *cl, const char *fmt, va_list va_args) {
 	int res = 0;
 
 	if (cl->compression)
 		res = client_vprintf_compressed(cl, fmt, va_args);
+	else if (cl->binary)
+		res = rcd_bin_vprintf(cl, fmt, va_args);
 	else
-		ustream_vprintf(&(cl)->sfd.stream, fmt, va_args);
+		res = client_vprintf_plain(cl, fmt, va_args);
 
 	return res;
 }
@@ -46,44 +94,174 @@ int client_printf(struct client *cl, const char *fmt, ...) {
 	return res;
 }
 
-void rcd_client_phy_event(struct phy *phy, const char *str)
+/* write a preformatted block of lines, compressed as one frame if needed */
+int client_send(struct client *cl, const void *data, size_t len)
 {
+#ifdef CONFIG_ZSTD
+	void *compressed;
+	size_t clen;
+
+	if (cl->compression) {
+		client_zstd_private(cl);
+		if (zstd_compress((void *) data, len, &compressed, &clen))
+			return -1;
+
+		client_write(cl, compressed, clen);
+		free(compressed);
+		return 0;
+	}
+#endif
+
+	if (cl->binary)
+		return rcd_bin_text(cl, data, len);
+
+	client_write(cl, data, len);
+	return 0;
+}
+
+static void
+client_bin_event(const struct rcd_event *ev, struct rcd_line **line)
+{
+	struct rcd_bin_event bev;
+	struct rcd_line *out;
 	struct client *cl;
 
-	list_for_each_entry(cl, &clients, list)
-		client_phy_printf(cl, phy, "%s\n", str);
+	rcd_bin_event_encode(ev, &bev);
+
+	list_for_each_entry(cl, &bclients, list) {
+		/* station ids are announced to everyone, filtered or not */
+		if (bev.announce_len)
+			client_write(cl, (char *) bev.announce, bev.announce_len);
+
+		if (!rcd_client_event_filter(cl, ev, &out))
+			continue;
+
+		if (!out && bev.type) {
+			rcd_bin_event_send(cl, &bev);
+			continue;
+		}
 
-	/* only fill the input buffer if there are connected clients */
-	if (rcd_has_clients(true))
-		zstd_read_fmt(NULL, "%s;%s\n", phy_name(phy), str);
+		if (!out && !(out = rcd_event_line(ev, line)))
+			continue;
+
+		rcd_bin_text(cl, out->data, out->len);
+		if (out != *line)
+			rcd_line_put(out);
+	}
 }
 
+void rcd_client_phy_event(const struct rcd_event *ev)
+{
+	struct rcd_line *line = NULL, *out;
+	struct client *cl;
+	bool shared = false;
+
+	list_for_each_entry(cl, &clients, list) {
+		out = rcd_client_event_line(cl, ev, &line);
+		if (!out)
+			continue;
+
+		client_write_line(cl, out, rcd_event_line_kind(ev), ev->phy,
+				  ev->has_mac ? ev->addr : NULL);
+		rcd_line_put(out);
+	}
+
+	list_for_each_entry(cl, &zclients, list) {
+		if (!cl->zbuf) {
+			shared = true;
+			continue;
+		}
+
+		out = rcd_client_event_line(cl, ev, &line);
+		if (!out)
+			continue;
+
+		zstd_buf_write(cl->zbuf, out->data, out->len);
+		rcd_line_put(out);
+	}
+
+	/* only fill the shared input buffer if there are clients using it */
+	if (shared && rcd_event_line(ev, &line))
+		zstd_buf_write(NULL, line->data, line->len);
+
+	if (!list_empty(&bclients))
+		client_bin_event(ev, &line);
+
+	if (line)
+		rcd_line_put(line);
+
+	rcd_projection_done();
+}
+
+#ifdef CONFIG_ZSTD
+static void
+client_zstd_broadcast(const char *str, size_t len)
+{
+	struct client *cl;
+	bool shared = false;
+	void *buf;
+	size_t clen;
+
+	/* in streaming mode, broadcasts become part of the compressed streams */
+	if (zstd_streaming()) {
+		list_for_each_entry(cl, &zclients, list) {
+			if (cl->zbuf)
+				zstd_buf_write(cl->zbuf, str, len);
+			else
+				shared = true;
+		}
+
+		if (shared)
+			zstd_buf_write(NULL, str, len);
+		return;
+	}
+
+	if (zstd_compress((void *) str, len, &buf, &clen))
+		return;
+
+	list_for_each_entry(cl, &zclients, list)
+		client_write(cl, buf, clen);
+
+	free(buf);
+}
+#endif
+
 void rcd_client_broadcast(const char *fmt, ...)
 {
+	char buf[256], *str = buf;
 	struct client *cl;
 	va_list va_args;
-	void *buf;
-	size_t len;
-	int err;
+	int len;
 
 	va_start(va_args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, va_args);
+	va_end(va_args);
+	if (len < 0)
+		return;
 
-	list_for_each_entry (cl, &clients, list)
-		client_vprintf(cl, fmt, va_args);
+	if (len >= (int) sizeof(buf)) {
+		str = malloc(len + 1);
+		if (!str)
+			return;
 
-	if (!list_empty(&zclients)) {
-		err = zstd_fmt_compress_va(&buf, &len, fmt, va_args);
-		if (err)
-			goto out;
+		va_start(va_args, fmt);
+		vsnprintf(str, len + 1, fmt, va_args);
+		va_end(va_args);
+	}
 
-		list_for_each_entry(cl, &zclients, list)
-			client_write(cl, buf, len);
+	list_for_each_entry(cl, &bclients, list)
+		rcd_bin_text(cl, str, len);
 
-		free(buf);
-	}
+	list_for_each_entry(cl, &clients, list)
+		client_write(cl, str, len);
 
-out:
-	va_end(va_args);
+#ifdef CONFIG_ZSTD
+	if (!list_empty(&zclients))
+		client_zstd_broadcast(str, len);
+#endif
+
+	if (str != buf)
+		free(str);
 }
 
 void rcd_client_set_phy_state(struct client *cl, struct phy *phy, bool add)
@@ -94,10 +272,16 @@ void rcd_client_set_phy_state(struct client *cl, struct phy *phy, bool add)
 
 		list_for_each_entry(cl, &zclients, list)
 			rcd_client_set_phy_state(cl, phy, add);
+
+		list_for_each_entry(cl, &bclients, list)
+			rcd_client_set_phy_state(cl, phy, add);
 		return;
 	}
 
 	if (add) {
+		if (cl->binary)
+			rcd_bin_phy_announce(cl, phy);
+
 		if (!cl->init_done) {
 			rcd_api_info_dump(cl, phy);
 			cl->init_done = true;
@@ -116,6 +300,9 @@ client_start(struct client *cl)
 
 	vlist_for_each_element(&phy_list, phy, node)
 		rcd_client_set_phy_state(cl, phy, true);
+
+	if (cl->binary)
+		rcd_bin_client_start(cl);
 }
 
 static int
@@ -150,7 +337,10 @@ client_notify_read(struct ustream *s, int bytes)
 		if (!data)
 			return;
 
-		len = client_handle_data(cl, data);
+		if (cl->binary)
+			len = rcd_bin_handle_data(cl, (uint8_t *) data, len);
+		else
+			len = client_handle_data(cl, data);
 		if (!len)
 			return;
 
@@ -158,6 +348,14 @@ client_notify_read(struct ustream *s, int bytes)
 	}
 }
 
+static void
+client_notify_write(struct ustream *s, int bytes)
+{
+	struct client *cl = container_of(s, struct client, sfd.stream);
+
+	client_queue_drain(cl);
+}
+
 static void
 client_notify_state(struct ustream *s)
 {
@@ -166,26 +364,70 @@ client_notify_state(struct ustream *s)
 	if (!s->write_error && !s->eof)
 		return;
 
+	rcd_client_filter_free(cl);
+	rcd_phy_control_client_free(cl);
+	rcd_debugfs_poll_client_free(cl);
+	client_queue_free(cl);
 	ustream_free(s);
 	close(cl->sfd.fd.fd);
 	list_del(&cl->list);
+	if (cl->binary && list_empty(&bclients))
+		rcd_bin_reset();
+	free(cl->bin_ts);
 	free(cl);
 }
 
-void rcd_client_accept(int fd, bool compression)
+static void
+client_init(struct client *cl, int fd, struct list_head *list)
 {
 	struct ustream *us;
-	struct client *cl;
 
-	cl = calloc(1, sizeof(*cl));
-	cl->compression = compression;
+	INIT_LIST_HEAD(&cl->subs);
+	INIT_LIST_HEAD(&cl->aggrs);
+	INIT_LIST_HEAD(&cl->queue);
+	INIT_LIST_HEAD(&cl->batch_list);
 	us = &cl->sfd.stream;
 	us->notify_read = client_notify_read;
+	us->notify_write = client_notify_write;
 	us->notify_state = client_notify_state;
 	us->string_data = true;
 	ustream_fd_init(&cl->sfd, fd);
-	list_add_tail(&cl->list, compression ? &zclients : &clients);
-	client_start(cl);
+	list_add_tail(&cl->list, list);
+
+	/* sent once the client has joined the stream, see rcd_client_zstd_resync() */
+	if (!cl->zstd_wait)
+		client_start(cl);
+}
+
+void rcd_client_accept(int fd, bool compression)
+{
+	struct client *cl;
+
+	cl = calloc(1, sizeof(*cl));
+	if (!cl) {
+		close(fd);
+		return;
+	}
+
+	cl->compression = compression;
+#ifdef CONFIG_ZSTD
+	cl->zstd_wait = compression && !zstd_buf_at_frame_start(NULL);
+#endif
+	client_init(cl, fd, compression ? &zclients : &clients);
+}
+
+void rcd_client_accept_binary(int fd)
+{
+	struct client *cl;
+
+	cl = calloc(1, sizeof(*cl));
+	if (!cl) {
+		close(fd);
+		return;
+	}
+
+	cl->binary = true;
+	client_init(cl, fd, &bclients);
 }
 
 bool
@@ -194,13 +436,61 @@ rcd_has_clients(bool compression)
 	return compression ? !list_empty(&zclients) : !list_empty(&clients);
 }
 
+void rcd_client_for_each(void (*cb)(struct client *cl, void *arg), void *arg)
+{
+	struct client *cl;
+
+	list_for_each_entry(cl, &clients, list)
+		cb(cl, arg);
+
+	list_for_each_entry(cl, &zclients, list)
+		cb(cl, arg);
+
+	list_for_each_entry(cl, &bclients, list)
+		cb(cl, arg);
+}
+
 #ifdef CONFIG_ZSTD
 void rcd_client_write(const void *buf, size_t len, bool compressed)
 {
 	struct client *cl;
 	struct list_head *head = compressed ? &zclients : &clients;
+	struct rcd_line *line;
+
+	/* one copy shared by the batches of all clients */
+	line = rcd_line_alloc(len);
+	if (line) {
+		memcpy(line->data, buf, len);
+		line->len = len;
+	}
+
+	list_for_each_entry(cl, head, list) {
+		/* clients with their own compression buffer or not in the stream yet */
+		if (cl->zbuf || cl->zstd_wait)
+			continue;
+
+		if (line)
+			client_write_line(cl, line, CLIENT_LINE_PROTECTED, NULL, NULL);
+		else
+			client_write(cl, buf, len);
+	}
 
-	list_for_each_entry(cl, head, list)
-		client_write(cl, buf, len);
+	if (line)
+		rcd_line_put(line);
+}
+
+/* the shared stream is at the start of a frame, let waiting clients join */
+void rcd_client_zstd_resync(void)
+{
+	struct client *cl;
+
+	list_for_each_entry(cl, &zclients, list) {
+		if (!cl->zstd_wait)
+			continue;
+
+		/* the initial state is sent as frames of its own before the stream */
+		client_start(cl);
+		cl->zstd_wait = false;
+	}
 }
 #endif
@@ -94,6 +94,118 @@ config_init_mqtt(void)
 }
 #endif
 
+void
+config_init_phy(struct phy_opts *o)
+{
+	struct uci_element *e;
+	const char *tmp;
+
+	if (!config)
+		return;
+
+	uci_foreach_element(&config->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		if (strcmp(s->type, "rcd") != 0)
+			continue;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "event_bufsize");
+		if (tmp)
+			o->event_bufsize = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "backend");
+		if (tmp)
+			o->backend = tmp;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "debugfs_root");
+		if (tmp)
+			o->debugfs_root = tmp;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "sysfs_root");
+		if (tmp)
+			o->sysfs_root = tmp;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "discovery");
+		if (tmp)
+			o->discovery = tmp;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "event_sample");
+		if (tmp)
+			o->event_sample = tmp;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "txs_summary_mqtt");
+		if (tmp)
+			o->txs_summary_mqtt = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "ingest_threads");
+		if (tmp)
+			o->ingest_threads = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "ingest_cpus");
+		if (tmp)
+			o->ingest_cpus = tmp;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "control_queue");
+		if (tmp)
+			o->control_queue = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "control_coalesce");
+		if (tmp)
+			o->control_coalesce = !!atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "synth_phys");
+		if (tmp)
+			o->synth_phys = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "synth_stations");
+		if (tmp)
+			o->synth_stations = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "synth_rate");
+		if (tmp)
+			o->synth_rate = atoi(tmp);
+		break;
+	}
+}
+
+void
+config_init_client(struct client_opts *o)
+{
+	struct uci_element *e;
+	const char *tmp;
+
+	if (!config)
+		return;
+
+	uci_foreach_element(&config->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		if (strcmp(s->type, "rcd") != 0)
+			continue;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "client_max_bytes");
+		if (tmp)
+			o->max_bytes = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "client_max_lines");
+		if (tmp)
+			o->max_lines = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "client_policy");
+		if (tmp)
+			o->policy = tmp;
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "client_batch_ms");
+		if (tmp)
+			o->batch_ms = atoi(tmp);
+
+		tmp = uci_lookup_option_string(uci_ctx, s, "metrics");
+		if (tmp)
+			o->metrics = tmp;
+		break;
+	}
+}
+
 #ifdef CONFIG_ZSTD
 static void
 config_parse_zstd(struct uci_section *s, struct zstd_opts *o)
@@ -113,12 +225,20 @@ config_parse_zstd(struct uci_section *s, struct zstd_opts *o)
 	tmp = uci_lookup_option_string(uci_ctx, s, "timeout_ms");
 	if (tmp)
 		o->timeout_ms = atoi(tmp);
+
+	tmp = uci_lookup_option_string(uci_ctx, s, "resync_ms");
+	if (tmp)
+		o->resync_ms = atoi(tmp);
 }
 
 void
 config_init_zstd(struct zstd_opts *o)
 {
 	struct uci_element *e;
+
+	if (!config)
+		return;
+
 	uci_foreach_element(&config->sections, e) {
 		struct uci_section *s = uci_to_section(e);
 
@@ -0,0 +1,319 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <errno.h>
+#include <time.h>
+#include "rcd.h"
+
+/*
+ * Non-blocking api_control writes. A command is written right away if
+ * nothing is queued for its PHY. If api_control does not take it (EAGAIN)
+ * or takes only part of it, the rest is queued per PHY and written in order
+ * once the fd becomes writable, so that a slow driver only delays the
+ * commands for its own PHY. At most control_queue commands are queued per
+ * PHY. Failed commands are reported to the client that issued them with a
+ * "<phy>;0;#error;<message>" line, unless it is gone by then.
+ *
+ * A command may carry a request ID chosen by the client, "@<id>;<phy>;...".
+ * Such a command is answered in any case, once the api_control write is
+ * complete or has failed, with the time it took since the command was
+ * received in microseconds (hex):
+ *
+ *   <phy>;0;#ack;<id>;<time>
+ *   <phy>;0;#error;<id>;<time>;<message>
+ *
+ * With coalescing enabled, rate/power commands that would not change what
+ * was last applied to a station (see rcd_phy_rc_applied()) are not written
+ * but acknowledged right away, and a queued rate/power command that is the
+ * last one for its station is superseded by a newer one of the same kind.
+ */
+struct phy_ctl_cmd {
+	struct list_head list;
+	struct client *cl;
+	struct rcd_request req;
+	/* station of a rate/power command */
+	bool rc;
+	uint8_t addr[6];
+	size_t len;
+	size_t pos;
+	char data[];
+};
+
+static unsigned int queue_max;
+static bool coalesce;
+
+void rcd_phy_control_init(unsigned int max, bool coalesce_rc)
+{
+	queue_max = max;
+	coalesce = coalesce_rc;
+}
+
+static uint64_t
+ctl_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* strip an optional "@<id>;" prefix, returns NULL if it is malformed */
+char *rcd_request_parse(struct rcd_request *req, char *data)
+{
+	char *sep;
+	size_t len;
+
+	req->id[0] = 0;
+	req->start = ctl_now_us();
+
+	if (*data != '@')
+		return data;
+
+	sep = strchr(++data, ';');
+	if (!sep)
+		return NULL;
+
+	len = sep - data;
+	if (!len || len > RCD_REQUEST_ID_MAX)
+		return NULL;
+
+	memcpy(req->id, data, len);
+	req->id[len] = 0;
+
+	return sep + 1;
+}
+
+/* err is NULL for success, which is only reported to requests with an ID */
+void rcd_request_reply(struct client *cl, struct phy *phy, const struct rcd_request *req,
+		       const char *err)
+{
+	const char *name = phy ? phy_name(phy) : "*";
+	unsigned long long time = 0;
+
+	if (req) {
+		time = ctl_now_us() - req->start;
+		rcd_hist_add(&rcd_stats.command_latency, time);
+	}
+
+	if (err)
+		rcd_stats.command_errors++;
+
+	if (!cl)
+		return;
+
+	if (!req || !req->id[0]) {
+		if (err)
+			client_printf(cl, "%s;0;#error;%s\n", name, err);
+		return;
+	}
+
+	if (err)
+		client_printf(cl, "%s;0;#error;%s;%llx;%s\n", name, req->id, time, err);
+	else
+		client_printf(cl, "%s;0;#ack;%s;%llx\n", name, req->id, time);
+}
+
+void rcd_phy_control_result(struct client *cl, struct phy *phy, const struct rcd_request *req,
+			    int error)
+{
+	rcd_request_reply(cl, phy, req, error ? strerror(error) : NULL);
+}
+
+/* returns EAGAIN if api_control can not take the rest of the command now */
+static int
+ctl_write(struct phy *phy, const char *data, size_t len, size_t *pos)
+{
+	ssize_t ret;
+
+	while (*pos < len) {
+		ret = write(phy->control_fd.fd, data + *pos, len - *pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return errno;
+
+		if (!ret)
+			return EIO;
+
+		*pos += ret;
+	}
+
+	return 0;
+}
+
+static void
+ctl_cmd_free(struct phy *phy, struct phy_ctl_cmd *cmd)
+{
+	list_del(&cmd->list);
+	phy->control_queued--;
+	free(cmd);
+}
+
+static void
+ctl_done(struct client *cl, struct phy *phy, const struct rcd_request *req, const char *data,
+	 int err)
+{
+	if (!err)
+		phy->control_stats.written++;
+
+	rcd_phy_rc_update(phy, data, err);
+	rcd_phy_control_result(cl, phy, req, err);
+}
+
+/*
+ * The last queued command that affects the station, if it is a rate/power
+ * command. pending is set if there is any such command.
+ */
+static struct phy_ctl_cmd *
+ctl_queued_sta(struct phy *phy, const uint8_t *addr, bool *pending)
+{
+	struct phy_ctl_cmd *cmd;
+	uint8_t cmd_addr[6];
+
+	*pending = true;
+	list_for_each_entry_reverse(cmd, &phy->control_queue, list) {
+		if (cmd->rc) {
+			if (!memcmp(cmd->addr, addr, sizeof(cmd->addr)))
+				return cmd;
+			continue;
+		}
+
+		/* other commands for the station or the whole PHY */
+		if (!rcd_phy_cmd_addr(cmd->data, cmd_addr) ||
+		    !memcmp(cmd_addr, addr, sizeof(cmd_addr)))
+			return NULL;
+	}
+
+	*pending = false;
+	return NULL;
+}
+
+static bool
+ctl_same_kind(const char *a, const char *b)
+{
+	size_t len = strcspn(a, ";");
+
+	return len == strcspn(b, ";") && !strncmp(a, b, len);
+}
+
+static void
+ctl_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct phy *phy = container_of(fd, struct phy, control_fd);
+	struct phy_ctl_cmd *cmd;
+	int err;
+
+	while (!list_empty(&phy->control_queue)) {
+		cmd = list_first_entry(&phy->control_queue, struct phy_ctl_cmd, list);
+		err = ctl_write(phy, cmd->data, cmd->len, &cmd->pos);
+		if (err == EAGAIN || err == EWOULDBLOCK)
+			return;
+
+		ctl_done(cmd->cl, phy, &cmd->req, cmd->data, err);
+		ctl_cmd_free(phy, cmd);
+	}
+
+	uloop_fd_delete(fd);
+}
+
+int rcd_phy_control_write(struct client *cl, struct phy *phy, const struct rcd_request *req,
+			  const char *data)
+{
+	struct phy_ctl_cmd *cmd, *prev = NULL;
+	size_t len = strlen(data), pos = 0;
+	uint8_t addr[6] = {};
+	bool rc, pending;
+	int err;
+
+	rc = rcd_phy_rc_cmd(data, addr);
+	if (rc && coalesce) {
+		prev = ctl_queued_sta(phy, addr, &pending);
+		if (!pending && rcd_phy_rc_applied(phy, addr, data)) {
+			phy->control_stats.skipped++;
+			rcd_phy_control_result(cl, phy, req, 0);
+			return 0;
+		}
+
+		if (prev && (prev->pos || !ctl_same_kind(prev->data, data)))
+			prev = NULL;
+	}
+
+	if (list_empty(&phy->control_queue)) {
+		err = ctl_write(phy, data, len, &pos);
+		if (err != EAGAIN && err != EWOULDBLOCK) {
+			ctl_done(cl, phy, req, data, err);
+			return err;
+		}
+	}
+
+	/* the newer command takes the place of the superseded one in the limit */
+	if (prev) {
+		phy->control_stats.coalesced++;
+		rcd_phy_control_result(prev->cl, phy, &prev->req, ECANCELED);
+		ctl_cmd_free(phy, prev);
+	}
+
+	/* once part of the command is written, the rest must follow */
+	if (!pos && phy->control_queued >= queue_max) {
+		err = ENOBUFS;
+		goto error;
+	}
+
+	cmd = malloc(sizeof(*cmd) + len + 1);
+	if (!cmd) {
+		err = ENOMEM;
+		goto error;
+	}
+
+	cmd->cl = cl;
+	cmd->req = *req;
+	cmd->rc = rc;
+	memcpy(cmd->addr, addr, sizeof(cmd->addr));
+	cmd->len = len;
+	cmd->pos = pos;
+	memcpy(cmd->data, data, len + 1);
+
+	if (list_empty(&phy->control_queue)) {
+		phy->control_fd.cb = ctl_fd_cb;
+		if (uloop_fd_add(&phy->control_fd, ULOOP_WRITE)) {
+			free(cmd);
+			err = EIO;
+			goto error;
+		}
+	}
+
+	list_add_tail(&cmd->list, &phy->control_queue);
+	phy->control_queued++;
+
+	return 0;
+
+error:
+	ctl_done(cl, phy, req, data, err);
+	return err;
+}
+
+/* the PHY is going away, its queued commands fail */
+void rcd_phy_control_free(struct phy *phy)
+{
+	struct phy_ctl_cmd *cmd, *tmp;
+
+	list_for_each_entry_safe(cmd, tmp, &phy->control_queue, list) {
+		rcd_phy_control_result(cmd->cl, phy, &cmd->req, ENODEV);
+		ctl_cmd_free(phy, cmd);
+	}
+
+	uloop_fd_delete(&phy->control_fd);
+}
+
+/* the client is going away, its queued commands are still written */
+void rcd_phy_control_client_free(struct client *cl)
+{
+	struct phy_ctl_cmd *cmd;
+	struct phy *phy;
+
+	vlist_for_each_element(&phy_list, phy, node)
+		list_for_each_entry(cmd, &phy->control_queue, list)
+			if (cmd->cl == cl)
+				cmd->cl = NULL;
+}
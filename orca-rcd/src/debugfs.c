@@ -34,7 +34,8 @@ mon_stop(struct mon_context *ctx)
 {
 	struct mon_client *cur, *next;
 
-	uloop_timeout_cancel(&ctx->buf.timeout);
+	if (ctx->compression)
+		zstd_buf_free(&ctx->buf);
 
 	list_for_each_entry_safe(cur, next, &ctx->clients, list) {
 		ustream_free(&cur->sfd.stream);
@@ -43,7 +44,6 @@ mon_stop(struct mon_context *ctx)
 		free(cur);
 	}
 
-	free(ctx->buf.in.buf);
 	uloop_fd_delete(&ctx->sfd);
 	close(ctx->sfd.fd);
 	uloop_fd_delete(&ctx->mon_fd);
@@ -131,6 +131,7 @@ mon_event_read_buf(struct mon_context *ctx, char *buf)
 
 	for (cur = buf; (next = strchr(cur, '\n')); cur = next + 1) {
 		*next = 0;
+		rcd_stats.monitor_lines++;
 
 		if (ctx->compression && !list_empty(&ctx->clients))
 			zstd_read_fmt(&ctx->buf, "%s\n", cur);
@@ -169,32 +170,29 @@ mon_event_cb(struct uloop_fd *fd, unsigned int events)
 		if (!len)
 			return;
 
+		rcd_stats.monitor_bytes += len;
 		buf[offset + len] = 0;
 		offset = mon_event_read_buf(ctx, buf);
 	}
 }
 
 static inline void
-mon_flush(struct zstd_buf *buf, const void *data, size_t len)
+mon_flush(struct zstd_buf *buf, const void *data, size_t len, bool end)
 {
 	struct mon_client *cl;
 	struct mon_context *ctx = container_of(buf, struct mon_context, buf);
 
 	list_for_each_entry(cl, &ctx->clients, list)
-		client_write(cl, data, len);
+		ustream_write(&cl->sfd.stream, data, len, false);
 }
 
 int
-rcd_debugfs_monitoring_start(const char *path, int port, size_t bufsize, unsigned int timeout,
+rcd_debugfs_monitoring_start(int fd, int port, size_t bufsize, unsigned int timeout,
                 	     bool compression)
 {
-	int fd, err;
+	int err;
 	struct mon_context *ctx;
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0)
-		return errno;
-
 	ctx = calloc(1, sizeof(*ctx));
 	if (!ctx) {
 		close(fd);
@@ -0,0 +1,757 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <errno.h>
+#include "rcd.h"
+
+/*
+ * Per-client event subscriptions. A client without subscriptions receives
+ * all events. Once it subscribes, it only receives events of PHYs it has a
+ * subscription for (either by name or through the '*' wildcard, a PHY's own
+ * subscription takes precedence), restricted to the subscribed event types
+ * and, for events that refer to a station, to the subscribed MAC set.
+ *
+ * A subscription can also project events of a type onto a subset of their
+ * fields. Projections are shared by all subscriptions that select the same
+ * fields, so the projected line is built only once per event. Finally, the
+ * txs/rxs events passed to a subscription can be sampled (see sample.c).
+ *
+ * Independently of its subscriptions, a client can opt into periodic txs
+ * summaries of a PHY (see aggr.c), which replace the PHY's raw txs events.
+ */
+struct rcd_projection {
+	struct list_head list;
+	unsigned int refcount;
+	uint64_t fields;
+
+	/* projected line of the event currently being handed out */
+	const struct rcd_event *ev;
+	struct rcd_line *line;
+	struct rcd_projection *next_used;
+};
+
+struct client_sub {
+	struct list_head list;
+	uint32_t types;
+	bool mac_filter;
+	struct mac_table macs;
+	struct rcd_projection *proj[__RCD_EV_MAX];
+	struct rcd_sampler *sampler;
+	char phy[];
+};
+
+/* timestamp and type are always part of a projected line */
+#define PROJ_FIELDS_MIN	3ULL
+#define PROJ_FIELDS_MAX	64
+
+static LIST_HEAD(projections);
+static struct rcd_projection *proj_used;
+
+struct client_aggr {
+	struct list_head list;
+	struct txs_aggr_user user;
+	struct client *cl;
+};
+
+#define SUB_TYPES_ALL	((1U << __RCD_EV_MAX) - 1)
+
+#ifdef CONFIG_ZSTD
+/*
+ * Compressed clients with subscriptions no longer get the shared zstd
+ * stream, they get their own buffer that only sees their events.
+ */
+struct client_zbuf {
+	struct zstd_buf buf;
+	struct client *cl;
+};
+
+static void
+client_zbuf_flush(struct zstd_buf *buf, const void *data, size_t len, bool end)
+{
+	struct client_zbuf *zb = container_of(buf, struct client_zbuf, buf);
+
+	client_write(zb->cl, data, len);
+}
+
+static int
+client_zbuf_start(struct client *cl)
+{
+	struct client_zbuf *zb;
+
+	if (!cl->compression || cl->zbuf)
+		return 0;
+
+	zb = calloc(1, sizeof(*zb));
+	if (!zb)
+		return ENOMEM;
+
+	if (zstd_buf_init_default(&zb->buf, client_zbuf_flush)) {
+		free(zb);
+		return ENOMEM;
+	}
+
+	/* hand out what the shared buffer collected so far before switching */
+	zstd_buf_flush(NULL);
+
+	zb->cl = cl;
+	cl->zbuf = &zb->buf;
+
+	return 0;
+}
+
+static void
+client_zbuf_stop(struct client *cl, bool flush)
+{
+	if (!cl->zbuf)
+		return;
+
+	if (flush) {
+		zstd_buf_flush(cl->zbuf);
+
+		/* in streaming mode, the client rejoins the shared stream at a new frame */
+		if (!zstd_buf_at_frame_start(NULL))
+			zstd_buf_flush(NULL);
+	}
+
+	zstd_buf_free(cl->zbuf);
+	free(container_of(cl->zbuf, struct client_zbuf, buf));
+	cl->zbuf = NULL;
+}
+#else
+static inline int client_zbuf_start(struct client *cl)
+{
+	return 0;
+}
+
+static inline void client_zbuf_stop(struct client *cl, bool flush)
+{
+}
+#endif
+
+/* the own buffer is only needed while the client filters its events */
+static void
+client_zbuf_check(struct client *cl)
+{
+	if (list_empty(&cl->subs) && list_empty(&cl->aggrs))
+		client_zbuf_stop(cl, true);
+}
+
+static void
+sub_mac_free(struct mac_entry *e)
+{
+	free(e);
+}
+
+static struct rcd_projection *
+projection_get(uint64_t fields)
+{
+	struct rcd_projection *proj;
+
+	list_for_each_entry(proj, &projections, list) {
+		if (proj->fields == fields) {
+			proj->refcount++;
+			return proj;
+		}
+	}
+
+	proj = calloc(1, sizeof(*proj));
+	if (!proj)
+		return NULL;
+
+	proj->refcount = 1;
+	proj->fields = fields;
+	list_add_tail(&proj->list, &projections);
+
+	return proj;
+}
+
+static void
+projection_put(struct rcd_projection *proj)
+{
+	if (!proj || --proj->refcount)
+		return;
+
+	/* commands never run while an event is handed out, so it is not in use */
+	list_del(&proj->list);
+	free(proj);
+}
+
+static struct rcd_line *
+projection_line(struct rcd_projection *proj, const struct rcd_event *ev)
+{
+	if (proj->ev == ev)
+		return proj->line;
+
+	proj->line = rcd_line_event(ev, proj->fields, ev->scale);
+	proj->ev = ev;
+	proj->next_used = proj_used;
+	proj_used = proj;
+
+	return proj->line;
+}
+
+/* release the projected lines of the event that was just handed out */
+void rcd_projection_done(void)
+{
+	struct rcd_projection *proj;
+
+	while (proj_used) {
+		proj = proj_used;
+		proj_used = proj->next_used;
+
+		if (proj->line)
+			rcd_line_put(proj->line);
+
+		proj->ev = NULL;
+		proj->line = NULL;
+		proj->next_used = NULL;
+	}
+}
+
+static void
+client_sub_free(struct client_sub *sub)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(sub->proj); i++)
+		projection_put(sub->proj[i]);
+
+	if (sub->sampler) {
+		rcd_sampler_free(sub->sampler);
+		free(sub->sampler);
+	}
+
+	list_del(&sub->list);
+	mac_table_flush(&sub->macs, sub_mac_free);
+	free(sub);
+}
+
+static struct client_sub *
+client_sub_find(struct client *cl, const char *phy)
+{
+	struct client_sub *sub;
+
+	list_for_each_entry(sub, &cl->subs, list)
+		if (!strcmp(sub->phy, phy))
+			return sub;
+
+	return NULL;
+}
+
+static struct client_sub *
+client_sub_get(struct client *cl, const char *name, int *err)
+{
+	struct client_sub *sub;
+
+	sub = client_sub_find(cl, name);
+	if (sub)
+		return sub;
+
+	*err = client_zbuf_start(cl);
+	if (*err)
+		return NULL;
+
+	sub = calloc(1, sizeof(*sub) + strlen(name) + 1);
+	if (!sub) {
+		*err = ENOMEM;
+		return NULL;
+	}
+
+	strcpy(sub->phy, name);
+	list_add_tail(&sub->list, &cl->subs);
+
+	return sub;
+}
+
+static int
+sub_parse_types(char *str, uint32_t *types)
+{
+	char *name;
+	int type;
+
+	*types = 0;
+
+	if (!str || !*str || !strcmp(str, "*")) {
+		*types = SUB_TYPES_ALL;
+		return 0;
+	}
+
+	while ((name = strsep(&str, ",")) != NULL) {
+		type = rcd_event_type_find(name, strlen(name));
+		if (type < 0)
+			return EINVAL;
+
+		*types |= 1U << type;
+	}
+
+	return 0;
+}
+
+/* check all addresses of a comma separated MAC list */
+static int
+sub_check_macs(const char *str)
+{
+	uint8_t addr[6];
+
+	if (!str)
+		return 0;
+
+	while (*str) {
+		if (!mac_parse(str, addr))
+			return EINVAL;
+
+		str += 17;
+		if (*str == ',')
+			str++;
+		else if (*str)
+			return EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+sub_add_macs(struct client_sub *sub, const char *str)
+{
+	struct mac_entry *e;
+	uint8_t addr[6];
+
+	for (; str && mac_parse(str, addr); str += 17 + !!str[17]) {
+		if (mac_table_get(&sub->macs, addr))
+			continue;
+
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			return ENOMEM;
+
+		memcpy(e->addr, addr, sizeof(e->addr));
+		if (mac_table_add(&sub->macs, e)) {
+			free(e);
+			return ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void
+sub_del_macs(struct client_sub *sub, const char *str)
+{
+	struct mac_entry *e;
+	uint8_t addr[6];
+
+	for (; str && mac_parse(str, addr); str += 17 + !!str[17]) {
+		e = mac_table_get(&sub->macs, addr);
+		if (!e)
+			continue;
+
+		mac_table_del(&sub->macs, e);
+		free(e);
+	}
+}
+
+/* <phy>;subscribe[;<types>[;<macs>]] */
+int rcd_client_subscribe(struct client *cl, struct phy *phy, char *args)
+{
+	const char *name = phy ? phy_name(phy) : "*";
+	struct client_sub *sub;
+	char *types_str, *macs;
+	uint32_t types;
+	int err;
+
+	types_str = strsep(&args, ";");
+	macs = args && *args ? args : NULL;
+
+	err = sub_parse_types(types_str, &types);
+	if (!err)
+		err = sub_check_macs(macs);
+	if (err)
+		return err;
+
+	sub = client_sub_get(cl, name, &err);
+	if (!sub)
+		return err;
+
+	sub->types |= types;
+	if (!macs)
+		return 0;
+
+	sub->mac_filter = true;
+	return sub_add_macs(sub, macs);
+}
+
+/* <phy>;unsubscribe[;<types>[;<macs>]] */
+int rcd_client_unsubscribe(struct client *cl, struct phy *phy, char *args)
+{
+	const char *name = phy ? phy_name(phy) : "*";
+	struct client_sub *sub;
+	char *types_str, *macs;
+	uint32_t types;
+	int err;
+
+	sub = client_sub_find(cl, name);
+	if (!sub)
+		return ENOENT;
+
+	types_str = strsep(&args, ";");
+	macs = args && *args ? args : NULL;
+
+	/* without arguments, the whole subscription is removed */
+	if ((!types_str || !*types_str) && !macs) {
+		client_sub_free(sub);
+		client_zbuf_check(cl);
+		return 0;
+	}
+
+	if (types_str && *types_str) {
+		err = sub_parse_types(types_str, &types);
+		if (err)
+			return err;
+
+		sub->types &= ~types;
+	}
+
+	err = sub_check_macs(macs);
+	if (err)
+		return err;
+
+	sub_del_macs(sub, macs);
+	return 0;
+}
+
+/* parse a comma separated list of field indexes and ranges, e.g. "0,2,6-7" */
+static int
+sub_parse_fields(char *str, uint64_t *fields)
+{
+	unsigned long first, last;
+	char *item, *end;
+
+	*fields = PROJ_FIELDS_MIN;
+
+	while ((item = strsep(&str, ",")) != NULL) {
+		first = strtoul(item, &end, 10);
+		last = first;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+
+		if (end == item || *end || first > last || last >= PROJ_FIELDS_MAX)
+			return EINVAL;
+
+		while (first <= last)
+			*fields |= 1ULL << first++;
+	}
+
+	return 0;
+}
+
+/* <phy>;project;<type>[;<fields>] */
+int rcd_client_project(struct client *cl, struct phy *phy, char *args)
+{
+	const char *name = phy ? phy_name(phy) : "*";
+	struct rcd_projection *proj = NULL;
+	struct client_sub *sub;
+	char *type_str;
+	uint64_t fields;
+	int type, err;
+
+	type_str = strsep(&args, ";");
+	if (!type_str)
+		return EINVAL;
+
+	type = rcd_event_type_find(type_str, strlen(type_str));
+	if (type < 0)
+		return EINVAL;
+
+	if (args && *args) {
+		err = sub_parse_fields(args, &fields);
+		if (err)
+			return err;
+
+		proj = projection_get(fields);
+		if (!proj)
+			return ENOMEM;
+	}
+
+	sub = client_sub_find(cl, name);
+	if (!sub && proj) {
+		/* a new subscription for projecting only passes all types */
+		sub = client_sub_get(cl, name, &err);
+		if (sub)
+			sub->types = SUB_TYPES_ALL;
+	}
+
+	if (!sub) {
+		projection_put(proj);
+		return proj ? err : 0;
+	}
+
+	projection_put(sub->proj[type]);
+	sub->proj[type] = proj;
+
+	return 0;
+}
+
+/* <phy>;sample[;<spec>] */
+int rcd_client_sample(struct client *cl, struct phy *phy, char *args)
+{
+	const char *name = phy ? phy_name(phy) : "*";
+	struct rcd_sampler sampler;
+	struct client_sub *sub;
+	int err;
+
+	err = rcd_sampler_parse(&sampler, args);
+	if (err)
+		return err;
+
+	sub = client_sub_find(cl, name);
+	if (!sub && !rcd_sampler_enabled(&sampler))
+		return 0;
+
+	if (!sub) {
+		/* a new subscription for sampling only passes all types */
+		sub = client_sub_get(cl, name, &err);
+		if (!sub)
+			return err;
+
+		sub->types = SUB_TYPES_ALL;
+	}
+
+	if (sub->sampler) {
+		rcd_sampler_free(sub->sampler);
+		free(sub->sampler);
+		sub->sampler = NULL;
+	}
+
+	if (!rcd_sampler_enabled(&sampler))
+		return 0;
+
+	sub->sampler = malloc(sizeof(*sub->sampler));
+	if (!sub->sampler)
+		return ENOMEM;
+
+	*sub->sampler = sampler;
+	return 0;
+}
+
+static void
+client_aggr_free(struct client_aggr *ca)
+{
+	txs_aggr_detach(&ca->user);
+	list_del(&ca->list);
+	free(ca);
+}
+
+/* summaries can be conflated per station in the output queue of a plain client */
+static void
+client_aggr_write(struct client *cl, struct txs_aggr_user *u, struct rcd_line *line)
+{
+	const char *str = strstr(line->data, ";txs_summary;");
+	uint8_t addr[6];
+
+	if (!str || !mac_parse(str + strlen(";txs_summary;"), addr)) {
+		client_write(cl, line->data, line->len);
+		return;
+	}
+
+	client_write_line(cl, line, CLIENT_LINE_SUMMARY, txs_aggr_phy(u), addr);
+}
+
+static void
+client_aggr_line(struct txs_aggr_user *u, struct rcd_line *line)
+{
+	struct client_aggr *ca = container_of(u, struct client_aggr, user);
+	struct client *cl = ca->cl;
+
+	/* the PHY is gone */
+	if (!line) {
+		client_aggr_free(ca);
+		client_zbuf_check(cl);
+		return;
+	}
+
+	if (cl->zbuf)
+		zstd_buf_write(cl->zbuf, line->data, line->len);
+	else if (!cl->compression && !cl->binary)
+		client_aggr_write(cl, u, line);
+	else
+		client_send(cl, line->data, line->len);
+}
+
+static struct client_aggr *
+client_aggr_find(struct client *cl, struct phy *phy)
+{
+	struct client_aggr *ca;
+
+	list_for_each_entry(ca, &cl->aggrs, list)
+		if (txs_aggr_phy(&ca->user) == phy)
+			return ca;
+
+	return NULL;
+}
+
+/* <phy>;txs_summary[;<interval_ms>] */
+int rcd_client_txs_summary(struct client *cl, struct phy *phy, char *args)
+{
+	struct client_aggr *ca;
+	unsigned long interval = 0;
+	char *end;
+	int err;
+
+	if (args && *args) {
+		interval = strtoul(args, &end, 10);
+		if (*end || interval > UINT32_MAX)
+			return EINVAL;
+	}
+
+	ca = client_aggr_find(cl, phy);
+	if (ca && !interval) {
+		client_aggr_free(ca);
+		client_zbuf_check(cl);
+		return 0;
+	}
+
+	if (!interval)
+		return 0;
+
+	if (ca) {
+		txs_aggr_detach(&ca->user);
+		goto attach;
+	}
+
+	err = client_zbuf_start(cl);
+	if (err)
+		return err;
+
+	ca = calloc(1, sizeof(*ca));
+	if (!ca) {
+		client_zbuf_check(cl);
+		return ENOMEM;
+	}
+
+	ca->cl = cl;
+	ca->user.cb = client_aggr_line;
+	list_add_tail(&ca->list, &cl->aggrs);
+
+attach:
+	err = txs_aggr_attach(phy, &ca->user, interval);
+	if (err) {
+		client_aggr_free(ca);
+		client_zbuf_check(cl);
+	}
+
+	return err;
+}
+
+static struct client_sub *
+client_sub_match(struct client *cl, const struct rcd_event *ev)
+{
+	struct client_sub *sub, *wildcard = NULL;
+	const char *name = phy_name(ev->phy);
+
+	list_for_each_entry(sub, &cl->subs, list) {
+		if (!strcmp(sub->phy, name))
+			goto found;
+
+		if (!strcmp(sub->phy, "*"))
+			wildcard = sub;
+	}
+
+	sub = wildcard;
+	if (!sub)
+		return NULL;
+
+found:
+	if (!(sub->types & (1U << ev->type)))
+		return NULL;
+
+	/* events without a station address are not subject to the MAC set */
+	if (!sub->mac_filter || !ev->has_mac)
+		return sub;
+
+	return mac_table_get(&sub->macs, ev->addr) ? sub : NULL;
+}
+
+/*
+ * Decide whether a client gets an event. If it gets the event in a modified
+ * form (projected or sampled), out is set to that line, with a reference
+ * held for the caller, otherwise to NULL.
+ */
+bool
+rcd_client_event_filter(struct client *cl, const struct rcd_event *ev, struct rcd_line **out)
+{
+	struct rcd_projection *proj;
+	struct client_sub *sub;
+	unsigned int scale = 1;
+
+	*out = NULL;
+
+	if (ev->type == RCD_EV_TXS && !list_empty(&cl->aggrs) &&
+	    client_aggr_find(cl, ev->phy))
+		return false;
+
+	if (list_empty(&cl->subs))
+		return true;
+
+	sub = client_sub_match(cl, ev);
+	if (!sub)
+		return false;
+
+	if (sub->sampler) {
+		scale = rcd_sample(sub->sampler, ev);
+		if (!scale)
+			return false;
+	}
+
+	proj = sub->proj[ev->type];
+
+	/* sampled lines carry their own marker and are not shared */
+	if (scale != 1) {
+		*out = rcd_line_event(ev, proj ? proj->fields : RCD_FIELDS_ALL,
+				      scale * ev->scale);
+		return *out != NULL;
+	}
+
+	if (!proj)
+		return true;
+
+	*out = projection_line(proj, ev);
+	if (!*out)
+		return false;
+
+	rcd_line_get(*out);
+	return true;
+}
+
+/*
+ * Return the line to send to a client for an event, with a reference held
+ * for the caller, or NULL if the client does not get the event. line is the
+ * unmodified line of the event, which is formatted on first use.
+ */
+struct rcd_line *
+rcd_client_event_line(struct client *cl, const struct rcd_event *ev, struct rcd_line **line)
+{
+	struct rcd_line *out;
+
+	if (!rcd_client_event_filter(cl, ev, &out))
+		return NULL;
+
+	if (out)
+		return out;
+
+	out = rcd_event_line(ev, line);
+	return out ? rcd_line_get(out) : NULL;
+}
+
+void rcd_client_filter_free(struct client *cl)
+{
+	struct client_sub *sub, *tmp;
+	struct client_aggr *ca, *ca_tmp;
+
+	list_for_each_entry_safe(sub, tmp, &cl->subs, list)
+		client_sub_free(sub);
+
+	list_for_each_entry_safe(ca, ca_tmp, &cl->aggrs, list)
+		client_aggr_free(ca);
+
+	client_zbuf_stop(cl, false);
+}
@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include "rcd.h"
+
+/*
+ * Lines that fit into RCD_LINE_POOL_SIZE bytes (which covers nearly all
+ * api_event lines) are recycled through a small free list instead of going
+ * back to the allocator, so the event path does not malloc/free per line.
+ */
+#define RCD_LINE_POOL_SIZE	256
+#define RCD_LINE_POOL_MAX	64
+
+static struct rcd_line *pool;
+static unsigned int pool_len;
+
+struct rcd_line *
+rcd_line_alloc(size_t len)
+{
+	struct rcd_line *line;
+	size_t size = len + 1;
+
+	if (size <= RCD_LINE_POOL_SIZE && pool) {
+		line = pool;
+		pool = line->next;
+		pool_len--;
+		goto out;
+	}
+
+	if (size < RCD_LINE_POOL_SIZE)
+		size = RCD_LINE_POOL_SIZE;
+
+	line = malloc(sizeof(*line) + size);
+	if (!line)
+		return NULL;
+
+	line->size = size;
+
+out:
+	line->next = NULL;
+	line->refcount = 1;
+	line->len = len;
+	line->data[len] = 0;
+	return line;
+}
+
+void
+rcd_line_put(struct rcd_line *line)
+{
+	if (--line->refcount)
+		return;
+
+	if (line->size != RCD_LINE_POOL_SIZE || pool_len >= RCD_LINE_POOL_MAX) {
+		free(line);
+		return;
+	}
+
+	line->next = pool;
+	pool = line;
+	pool_len++;
+}
+
+/*
+ * Format an event line as "<phy>;<fields>\n". fields selects the ';'-separated
+ * fields of the event to include (RCD_FIELDS_ALL for the unmodified line),
+ * a scale other than 1 appends the ";s=<scale>" marker of sampled events.
+ */
+struct rcd_line *
+rcd_line_event(const struct rcd_event *ev, uint64_t fields, unsigned int scale)
+{
+	const char *name = phy_name(ev->phy);
+	const char *cur = ev->str, *end = ev->str + ev->len, *sep;
+	size_t name_len = strlen(name), len;
+	struct rcd_line *line;
+	unsigned int i;
+	char *out;
+
+	line = rcd_line_alloc(name_len + 1 + ev->len + RCD_SCALE_MARKER_LEN + 1);
+	if (!line)
+		return NULL;
+
+	out = line->data;
+	memcpy(out, name, name_len);
+	out += name_len;
+
+	if (fields == RCD_FIELDS_ALL) {
+		*out++ = ';';
+		memcpy(out, ev->str, ev->len);
+		out += ev->len;
+		goto marker;
+	}
+
+	for (i = 0; cur < end; i++, cur = sep + 1) {
+		sep = memchr(cur, ';', end - cur);
+		if (!sep)
+			sep = end;
+
+		if (i >= 64 || !(fields & (1ULL << i)))
+			continue;
+
+		len = sep - cur;
+		*out++ = ';';
+		memcpy(out, cur, len);
+		out += len;
+	}
+
+marker:
+	if (scale != 1)
+		out += snprintf(out, RCD_SCALE_MARKER_LEN + 1, ";s=%u", scale);
+
+	*out++ = '\n';
+	*out = 0;
+	line->len = out - line->data;
+
+	return line;
+}
+
+/* the unmodified line of an event, formatted on first use */
+struct rcd_line *
+rcd_event_line(const struct rcd_event *ev, struct rcd_line **line)
+{
+	if (!*line)
+		*line = rcd_line_event(ev, RCD_FIELDS_ALL, ev->scale);
+
+	return *line;
+}
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <errno.h>
+#include "rcd.h"
+
+/*
+ * Hash table of entries keyed by MAC address. Entries are embedded into the
+ * user's structure and chained per bucket. The bucket array is allocated on
+ * the first insert and doubled whenever the table holds more entries than
+ * buckets, so lookups stay O(1) with thousands of stations.
+ */
+#define MAC_TABLE_MIN_SIZE	16
+
+static inline int
+mac_hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+bool mac_parse(const char *str, uint8_t *addr)
+{
+	int i, hi, lo;
+
+	for (i = 0; i < 6; i++) {
+		hi = mac_hexval(str[0]);
+		lo = hi < 0 ? -1 : mac_hexval(str[1]);
+		if (lo < 0)
+			return false;
+
+		addr[i] = (hi << 4) | lo;
+		str += 2;
+
+		if (i < 5 && *str++ != ':')
+			return false;
+	}
+
+	/* the address must be followed by a separator or the end of the string */
+	return *str != ':' && mac_hexval(*str) < 0;
+}
+
+static inline unsigned int
+mac_hash(const uint8_t *addr)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, addr, 6);
+	return (v * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static int
+mac_table_resize(struct mac_table *t, unsigned int size)
+{
+	struct mac_entry **buckets, *e, *next;
+	unsigned int i, idx;
+
+	buckets = calloc(size, sizeof(*buckets));
+	if (!buckets)
+		return -ENOMEM;
+
+	for (i = 0; t->buckets && i <= t->mask; i++) {
+		for (e = t->buckets[i]; e; e = next) {
+			next = e->next;
+			idx = mac_hash(e->addr) & (size - 1);
+			e->next = buckets[idx];
+			buckets[idx] = e;
+		}
+	}
+
+	free(t->buckets);
+	t->buckets = buckets;
+	t->mask = size - 1;
+
+	return 0;
+}
+
+struct mac_entry *
+mac_table_get(struct mac_table *t, const uint8_t *addr)
+{
+	struct mac_entry *e;
+
+	if (!t->count)
+		return NULL;
+
+	for (e = t->buckets[mac_hash(addr) & t->mask]; e; e = e->next)
+		if (!memcmp(e->addr, addr, sizeof(e->addr)))
+			return e;
+
+	return NULL;
+}
+
+int mac_table_add(struct mac_table *t, struct mac_entry *e)
+{
+	unsigned int idx;
+
+	if (!t->buckets || t->count > t->mask) {
+		if (mac_table_resize(t, t->buckets ? 2 * (t->mask + 1) : MAC_TABLE_MIN_SIZE) &&
+		    !t->buckets)
+			return -ENOMEM;
+	}
+
+	idx = mac_hash(e->addr) & t->mask;
+	e->next = t->buckets[idx];
+	t->buckets[idx] = e;
+	t->count++;
+
+	return 0;
+}
+
+void mac_table_del(struct mac_table *t, struct mac_entry *e)
+{
+	struct mac_entry **cur;
+
+	for (cur = &t->buckets[mac_hash(e->addr) & t->mask]; *cur; cur = &(*cur)->next) {
+		if (*cur != e)
+			continue;
+
+		*cur = e->next;
+		t->count--;
+		return;
+	}
+}
+
+void mac_table_flush(struct mac_table *t, void (*free_cb)(struct mac_entry *e))
+{
+	struct mac_entry *e, *next;
+	unsigned int i;
+
+	for (i = 0; t->buckets && i <= t->mask; i++) {
+		for (e = t->buckets[i]; e; e = next) {
+			next = e->next;
+			free_cb(e);
+		}
+	}
+
+	free(t->buckets);
+	t->buckets = NULL;
+	t->mask = 0;
+	t->count = 0;
+}
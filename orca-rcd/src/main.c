@@ -14,15 +14,48 @@ static void
 usage(void)
 {
 	fprintf(stderr, "orca-rcd " ORCA_RCD_VERSION "\n\n");
-	fprintf(stderr, "usage: orca-rcd [-h INTERFACE]");
+	fprintf(stderr, "usage: orca-rcd [-h INTERFACE] [-r EVENT_BUFSIZE] [-d DEBUGFS_ROOT] [-S SYSFS_ROOT]"
+			" [-s PHYS,STATIONS,RATE] [-j THREADS] [-a CPUS] [-q CONTROL_QUEUE] [-k]"
+			" [-Q MAX_BYTES] [-L MAX_LINES]"
+			" [-P POLICY] [-w BATCH_MS] [-m [ADDRESS:]PORT]");
 #ifdef CONFIG_MQTT
 	fprintf(stderr, " [-i ID] [-t TOPIC_PREFIX] [-b BROKER]");
 #endif
 #ifdef CONFIG_ZSTD
-	fprintf(stderr, " [-D DICT] [-c COMPRESSIONLEVEL] [-B BUFSIZE] [-T TIMEOUT_MS]");
+	fprintf(stderr, " [-D DICT] [-c COMPRESSIONLEVEL] [-B BUFSIZE] [-T TIMEOUT_MS] [-R RESYNC_MS]");
 #endif
 	fprintf(stderr, "\n");
 
+	fprintf(stderr, "PHY options: [-r EVENT_BUFSIZE] [-d DEBUGFS_ROOT] [-S SYSFS_ROOT] [-s PHYS,STATIONS,RATE]"
+			" [-j THREADS] [-a CPUS] [-q CONTROL_QUEUE] [-k]\n"
+			"	EVENT_BUFSIZE sets the size of the per-PHY api_event ring buffer, which also\n"
+			"	bounds the size of a single read (default 16384)\n"
+			"	DEBUGFS_ROOT is the directory containing the PHYs' debugfs directories\n"
+			"	(default /sys/kernel/debug/ieee80211)\n"
+			"	SYSFS_ROOT is the directory in which PHYs are discovered (default /sys/class/ieee80211)\n"
+			"	-s replaces the kernel API by a synthetic backend emulating PHYS PHYs with STATIONS\n"
+			"	stations each, generating RATE events per second and PHY\n"
+			"	THREADS is the number of PHYs whose api_event is read by a thread of its own\n"
+			"	(default 0, all PHYs are read by the main loop)\n"
+			"	CPUS is a comma separated list of CPUs the reader threads are pinned to in turn\n"
+			"	CONTROL_QUEUE is the number of commands held per PHY while its api_control\n"
+			"	is not writable (default 64)\n"
+			"	-k skips rate/power commands that repeat what was last applied to a station\n"
+			"	and lets queued ones be superseded by newer ones\n");
+
+	fprintf(stderr, "Client options: [-Q MAX_BYTES] [-L MAX_LINES] [-P POLICY] [-w BATCH_MS]"
+			" [-m [ADDRESS:]PORT]\n"
+			"	MAX_BYTES is the output a client may have pending before POLICY applies\n"
+			"	(default 4194304, 0 is unlimited)\n"
+			"	MAX_LINES additionally limits the number of lines queued for a plain client\n"
+			"	(default 0, unlimited)\n"
+			"	POLICY is one of 'disconnect', 'drop' (oldest txs/rxs/stats lines first,\n"
+			"	the default) or 'conflate' (keep only the latest stats/txs_summary line\n"
+			"	per station, then drop)\n"
+			"	BATCH_MS is how long client output may be held to be written in one go\n"
+			"	(default 0, until the end of the current main loop iteration)\n"
+			"	-m serves metrics to Prometheus on PORT, on ADDRESS or 127.0.0.1\n");
+
 #ifdef CONFIG_MQTT
 	fprintf(stderr, "MQTT options: [-i ID] [-t TOPIC_PREFIX] [-b BROKER]\n"
 			"       ID is used to identify with the broker,\n"
@@ -33,11 +66,13 @@ usage(void)
 #endif
 
 #ifdef CONFIG_ZSTD
-	fprintf(stderr, "zstd compression options: [-D DICT] [-c COMPRESSIONLEVEL] [-B BUFSIZE] [-T TIMEOUT_MS]\n"
+	fprintf(stderr, "zstd compression options: [-D DICT] [-c COMPRESSIONLEVEL] [-B BUFSIZE] [-T TIMEOUT_MS] [-R RESYNC_MS]\n"
 			"	DICT is the path to a zstd dictionary file (default /lib/orca-rcd/dictionary/zdict)\n"
 			"	COMPRESSIONLEVEL sets the zstd compression level (default 3)\n"
 			"	BUFSIZE sets the size of the buffer where data is collected before compression (default 4096)\n"
-			"	TIMEOUT_MS sets the maximum wait time in milliseconds between flushes of the compression buffer (default 1000).\n");
+			"	TIMEOUT_MS sets the maximum wait time in milliseconds between flushes of the compression buffer (default 1000).\n"
+			"	RESYNC_MS enables streaming mode, in which a zstd frame spans many flushes and is only\n"
+			"	ended every RESYNC_MS milliseconds (default 0, one frame per flush)\n");
 #endif
 }
 
@@ -49,6 +84,16 @@ rcd_stop(int signo)
 	if (stopped)
 		return;
 
+	/*
+	 * From a signal handler, only end the main loop. The cleanup below
+	 * runs once uloop_run() has returned, as it synchronizes with the
+	 * compression thread.
+	 */
+	if (signo >= 0) {
+		uloop_end();
+		return;
+	}
+
 #ifdef CONFIG_ZSTD
 	rcd_debugfs_monitoring_stop();
 	zstd_stop(true);
@@ -56,6 +101,7 @@ rcd_stop(int signo)
 #ifdef CONFIG_MQTT
 	mqtt_stop();
 #endif
+	rcd_client_flush();
 	uloop_end();
 
 	stopped = true;
@@ -89,8 +135,13 @@ int main(int argc, char **argv)
 	const char *capath = "/etc/ssl/certs/";
 #endif
 
+	struct phy_opts phyopts = PHY_OPTS_DEFAULTS;
+	struct client_opts clientopts = CLIENT_OPTS_DEFAULTS;
+
 	uloop_init();
 	rcd_config_init();
+	config_init_phy(&phyopts);
+	config_init_client(&clientopts);
 
 #ifdef CONFIG_ZSTD
 	struct zstd_buf zstd_buf;
@@ -98,8 +149,52 @@ int main(int argc, char **argv)
 	config_init_zstd(&zstdopts);
 #endif
 
-	while ((ch = getopt(argc, argv, "h:i:C:b:t:D:c:B:T:")) != -1) {
+	while ((ch = getopt(argc, argv, "h:r:d:S:s:j:a:q:kQ:L:P:w:m:i:C:b:t:D:c:B:T:R:")) != -1) {
 		switch (ch) {
+		case 'r':
+			phyopts.event_bufsize = atoi(optarg);
+			break;
+		case 'd':
+			phyopts.debugfs_root = optarg;
+			break;
+		case 'S':
+			phyopts.sysfs_root = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%u,%u,%u", &phyopts.synth_phys,
+				   &phyopts.synth_stations, &phyopts.synth_rate) != 3) {
+				usage();
+				exit(1);
+			}
+			phyopts.backend = "synthetic";
+			break;
+		case 'j':
+			phyopts.ingest_threads = atoi(optarg);
+			break;
+		case 'a':
+			phyopts.ingest_cpus = optarg;
+			break;
+		case 'q':
+			phyopts.control_queue = atoi(optarg);
+			break;
+		case 'k':
+			phyopts.control_coalesce = true;
+			break;
+		case 'Q':
+			clientopts.max_bytes = atoi(optarg);
+			break;
+		case 'L':
+			clientopts.max_lines = atoi(optarg);
+			break;
+		case 'P':
+			clientopts.policy = optarg;
+			break;
+		case 'w':
+			clientopts.batch_ms = atoi(optarg);
+			break;
+		case 'm':
+			clientopts.metrics = optarg;
+			break;
 		case 'h':
 			rcd_server_add(optarg);
 #ifdef CONFIG_MQTT
@@ -131,6 +226,9 @@ int main(int argc, char **argv)
 		case 'T':
 			zstdopts.timeout_ms = atoi(optarg);
 			break;
+		case 'R':
+			zstdopts.resync_ms = atoi(optarg);
+			break;
 #endif
 		default:
 			usage();
@@ -147,8 +245,24 @@ int main(int argc, char **argv)
 	}
 #endif
 
-	rcd_phy_init();
+	if (!phyopts.event_bufsize) {
+		fprintf(stderr, "ERROR: event buffer size must not be 0\n");
+		return -1;
+	}
+
+	if (rcd_client_queue_init(&clientopts)) {
+		fprintf(stderr, "ERROR: unknown client output policy '%s'\n", clientopts.policy);
+		return -1;
+	}
+
+	if (rcd_phy_init(&phyopts)) {
+		uloop_end();
+		return -1;
+	}
+
 	rcd_server_init();
+	if (rcd_stats_init(clientopts.metrics))
+		fprintf(stderr, "WARNING: Failed to open metrics port %s\n", clientopts.metrics);
 #ifdef CONFIG_MQTT
 	mqtt_init();
 #endif
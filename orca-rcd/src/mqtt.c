@@ -166,7 +166,7 @@ mqtt_publish(struct mqtt_context *ctx, const char *topic, const void *data, int
 			 bool retain, int qos, mosquitto_property *props)
 {
 	static char buf[TOPIC_MAXLEN + 1];
-	int chars;
+	int chars, err;
 
 	chars = snprintf(buf, TOPIC_MAXLEN, api ? "%s%s/api/%s" : "%s%s/%s",
 		ctx->topic_prefix ? ctx->topic_prefix : "",
@@ -174,10 +174,17 @@ mqtt_publish(struct mqtt_context *ctx, const char *topic, const void *data, int
 
 	if (chars >= TOPIC_MAXLEN) {
 		fprintf(stderr, "Topic exceeds maximum length of %d\n", TOPIC_MAXLEN);
+		rcd_stats.mqtt_errors++;
 		return -1;
 	}
 
-	return mosquitto_publish_v5(ctx->mosq, NULL, buf, len, data, qos, retain, props);
+	err = mosquitto_publish_v5(ctx->mosq, NULL, buf, len, data, qos, retain, props);
+	if (err)
+		rcd_stats.mqtt_errors++;
+	else
+		rcd_stats.mqtt_published++;
+
+	return err;
 }
 
 static inline int
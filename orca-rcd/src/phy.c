@@ -3,70 +3,533 @@
 /* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
 
 #include <libubox/avl-cmp.h>
-#include <glob.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <libgen.h>
+#include <time.h>
 #include "rcd.h"
 
+#define DEBUGFS_CHUNK		4096
+#define DEBUGFS_BATCH_MAX	32
+
 static void phy_update(struct vlist_tree *tree, struct vlist_node *node_new,
 		       struct vlist_node *node_old);
 
 VLIST_TREE(phy_list, avl_strcmp, phy_update, true, false);
 
-static const char *
-phy_file_path(struct phy *phy, const char *file)
+static struct phy_opts opts = PHY_OPTS_DEFAULTS;
+
+static const struct phy_backend *backends[] = {
+	&phy_debugfs_backend,
+	&phy_synth_backend,
+};
+
+static const struct phy_backend *backend;
+
+static inline int
+phy_open(struct phy *phy, const char *file, int flags)
+{
+	return backend->open(phy, file, flags);
+}
+
+static inline int
+phy_debugfs_open(struct phy *phy, const char *file, int flags)
 {
-	static char path[64];
+	return backend->debugfs_open(phy, file, flags);
+}
+
+static FILE *
+phy_fopen(struct phy *phy, const char *file)
+{
+	FILE *f;
+	int fd;
+
+	fd = phy_open(phy, file, O_RDONLY);
+	if (fd < 0)
+		return NULL;
 
-	snprintf(path, sizeof(path), "/sys/kernel/debug/ieee80211/%s/rc/%s", phy_name(phy), file);
+	f = fdopen(fd, "r");
+	if (!f)
+		close(fd);
 
-	return path;
+	return f;
 }
 
-static const char *
-phy_debugfs_file_path(struct phy *phy, const char *file)
+/* entry of a PHY's station table, info holds the fields following the MAC */
+struct phy_sta {
+	struct mac_entry node;
+	char *info;
+	/* last rate/power command written for the station, see rcd_phy_rc_update() */
+	char *applied;
+};
+
+static void
+phy_sta_free(struct mac_entry *e)
 {
-	static char path[128];
+	struct phy_sta *sta = container_of(e, struct phy_sta, node);
 
-	snprintf(path, sizeof(path), "/sys/kernel/debug/ieee80211/%s/%s",
-	         phy_name(phy), file);
+	free(sta->applied);
+	free(sta->info);
+	free(sta);
+}
 
-	return path;
+static struct phy_sta *
+phy_sta_get(struct phy *phy, const uint8_t *addr)
+{
+	struct mac_entry *e;
+
+	e = mac_table_get(&phy->stations, addr);
+	return e ? container_of(e, struct phy_sta, node) : NULL;
 }
 
-static int
-phy_event_read_buf(struct phy *phy, char *buf)
+static void
+phy_sta_rc_clear(struct phy_sta *sta)
+{
+	free(sta->applied);
+	sta->applied = NULL;
+}
+
+static void
+phy_sta_set(struct phy *phy, const uint8_t *addr, const char *info)
 {
-	char *cur, *next;
-	int len;
+	struct mac_entry *e;
+	struct phy_sta *sta;
+	char *info_buf;
 
-	for (cur = buf; (next = strchr(cur, '\n')); cur = next + 1) {
-		*next = 0;
+	info_buf = strdup(info);
+	if (!info_buf)
+		return;
 
-		rcd_client_phy_event(phy, cur);
+	e = mac_table_get(&phy->stations, addr);
+	if (e) {
+		sta = container_of(e, struct phy_sta, node);
+		free(sta->info);
+		sta->info = info_buf;
+		return;
+	}
+
+	sta = calloc(1, sizeof(*sta));
+	if (!sta)
+		goto error;
+
+	memcpy(sta->node.addr, addr, sizeof(sta->node.addr));
+	sta->info = info_buf;
+	if (!mac_table_add(&phy->stations, &sta->node))
+		return;
+
+	free(sta);
+error:
+	free(info_buf);
+}
+
+/* a (re)associated station starts out with the driver's rate/power state */
+static void
+phy_sta_add(struct phy *phy, const uint8_t *addr, const char *info)
+{
+	struct phy_sta *sta;
+
+	phy_sta_set(phy, addr, info);
+
+	sta = phy_sta_get(phy, addr);
+	if (sta)
+		phy_sta_rc_clear(sta);
+}
+
+static void
+phy_sta_del(struct phy *phy, const uint8_t *addr)
+{
+	struct mac_entry *e;
+
+	e = mac_table_get(&phy->stations, addr);
+	if (!e)
+		return;
+
+	mac_table_del(&phy->stations, e);
+	phy_sta_free(e);
+}
+
+/* sta;<add|remove|update>;<macaddr>;<info> */
+static void
+phy_sta_event(struct phy *phy, const struct rcd_event *ev)
+{
+	const char *action, *info;
+
+	action = strchr(ev->str, ';') + 1 + strlen("sta;");
+	info = strchr(action, ';') + 1 + 17;
+	if (*info == ';')
+		info++;
+
+	if (!strncmp(action, "remove;", 7))
+		phy_sta_del(phy, ev->addr);
+	else if (!strncmp(action, "update;", 7))
+		phy_sta_set(phy, ev->addr, info);
+	else if (!strncmp(action, "add;", 4))
+		phy_sta_add(phy, ev->addr, info);
+}
+
+/*
+ * Applied rate/power state. The last set_rates, set_power or set_rates_power
+ * command that was written for a station is kept with the station, so that
+ * an identical command can be recognized as a no-op (see control.c). Any
+ * other command that may affect the station invalidates it, as do a new
+ * association and lost events.
+ */
+static const char * const phy_rc_cmds[] = {
+	"set_rates",
+	"set_power",
+	"set_rates_power",
+};
+
+/* <command>;<macaddr>;..., returns false if the command does not name a station */
+bool rcd_phy_cmd_addr(const char *cmd, uint8_t *addr)
+{
+	const char *sep = strchr(cmd, ';');
+
+	return sep && mac_parse(sep + 1, addr);
+}
+
+bool rcd_phy_rc_cmd(const char *cmd, uint8_t *addr)
+{
+	size_t len = strcspn(cmd, ";");
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(phy_rc_cmds); i++)
+		if (strlen(phy_rc_cmds[i]) == len && !strncmp(cmd, phy_rc_cmds[i], len))
+			return rcd_phy_cmd_addr(cmd, addr);
+
+	return false;
+}
+
+bool rcd_phy_rc_applied(struct phy *phy, const uint8_t *addr, const char *cmd)
+{
+	struct phy_sta *sta;
+
+	/* sta events may have been lost */
+	if (phy->stations_stale)
+		return false;
+
+	sta = phy_sta_get(phy, addr);
+	return sta && sta->applied && !strcmp(sta->applied, cmd);
+}
+
+/* a command was written to api_control, or failed to be */
+void rcd_phy_rc_update(struct phy *phy, const char *cmd, int error)
+{
+	struct mac_entry *e;
+	struct phy_sta *sta;
+	uint8_t addr[6];
+	unsigned int i;
+
+	if (rcd_phy_rc_cmd(cmd, addr)) {
+		sta = phy_sta_get(phy, addr);
+		if (!sta)
+			return;
+
+		phy_sta_rc_clear(sta);
+		if (!error)
+			sta->applied = strdup(cmd);
+		return;
+	}
+
+	if (rcd_phy_cmd_addr(cmd, addr)) {
+		sta = phy_sta_get(phy, addr);
+		if (sta)
+			phy_sta_rc_clear(sta);
+		return;
+	}
+
+	mac_table_for_each(&phy->stations, e, i)
+		phy_sta_rc_clear(container_of(e, struct phy_sta, node));
+}
+
+/* (re)populate the station table from the sta lines in api_phy */
+static void
+phy_stations_load(struct phy *phy)
+{
+	char buf[256], *info;
+	uint8_t addr[6];
+	FILE *f;
+
+	mac_table_flush(&phy->stations, phy_sta_free);
+	phy->stations_stale = false;
+
+	f = phy_fopen(phy, "api_phy");
+	if (!f)
+		return;
+
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		if (strncmp(buf, "sta;", 4) || !mac_parse(buf + 4, addr))
+			continue;
+
+		info = buf + 4 + 17;
+		if (*info == ';')
+			info++;
+
+		info[strcspn(info, "\n")] = 0;
+		phy_sta_set(phy, addr, info);
+	}
+
+	fclose(f);
+}
+
+static void
+phy_snapshot_invalidate(struct phy_snapshot *snap)
+{
+	if (snap->plain)
+		rcd_line_put(snap->plain);
+	if (snap->zstd)
+		rcd_line_put(snap->zstd);
+
+	snap->plain = snap->zstd = NULL;
+}
+
+static const char * const event_types[] = {
+	[RCD_EV_TXS] = "txs",
+	[RCD_EV_RXS] = "rxs",
+	[RCD_EV_STATS] = "stats",
+	[RCD_EV_STA] = "sta",
+	[RCD_EV_IF] = "if",
+	[RCD_EV_OTHER] = "other",
+};
+
+int rcd_event_type_find(const char *name, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(event_types); i++)
+		if (!strncmp(event_types[i], name, len) && !event_types[i][len])
+			return i;
+
+	return -1;
+}
+
+/* parse the event type and the station address, if the event has one */
+static void
+phy_event_parse(struct rcd_event *ev, struct phy *phy, const char *str, size_t len)
+{
+	const char *type, *field;
+	int idx;
+
+	ev->phy = phy;
+	ev->str = str;
+	ev->len = len;
+	ev->type = RCD_EV_OTHER;
+	ev->has_mac = false;
+	ev->scale = 1;
+
+	type = strchr(str, ';');
+	if (!type)
+		return;
+
+	field = strchr(++type, ';');
+	if (!field)
+		return;
+
+	idx = rcd_event_type_find(type, field++ - type);
+	if (idx < 0 || idx == RCD_EV_OTHER)
+		return;
+
+	ev->type = idx;
+	switch (ev->type) {
+	case RCD_EV_STA:
+		/* sta;<add|remove|update>;<macaddr>;... */
+		field = strchr(field, ';');
+		if (!field)
+			return;
+		field++;
+		break;
+	case RCD_EV_IF:
+		return;
+	default:
+		break;
+	}
+
+	ev->has_mac = mac_parse(field, ev->addr);
+}
+
+static void
+phy_event_check_state(struct phy *phy, const struct rcd_event *ev)
+{
+	/* interface and station changes make the cached initial state stale */
+	if (ev->type == RCD_EV_STA) {
+		if (ev->has_mac)
+			phy_sta_event(phy, ev);
+		phy_snapshot_invalidate(&phy->state);
+	} else if (ev->type == RCD_EV_IF) {
+		phy_snapshot_invalidate(&phy->state);
+	}
+}
+
+#ifdef CONFIG_MQTT
+static void
+phy_event_mqtt(struct phy *phy, const struct rcd_event *ev)
+{
+	char *str;
+
+	/* replaced by the periodic summaries */
+	if (ev->type == RCD_EV_TXS && phy->mqtt_aggr.aggr)
+		return;
+
+	if (ev->scale == 1) {
+		mqtt_phy_event(phy, ev->str);
+		return;
+	}
+
+	str = malloc(ev->len + RCD_SCALE_MARKER_LEN + 1);
+	if (!str)
+		return;
+
+	sprintf(str, "%s;s=%u", ev->str, ev->scale);
+	mqtt_phy_event(phy, str);
+	free(str);
+}
+
+static void
+phy_mqtt_txs_summary(struct txs_aggr_user *u, struct rcd_line *line)
+{
+	struct phy *phy = container_of(u, struct phy, mqtt_aggr);
+	size_t prefix = strlen(phy_name(phy)) + 1;
+	char *str;
+
+	if (!line)
+		return;
+
+	/* MQTT messages carry neither the PHY prefix nor the newline */
+	str = strndup(line->data + prefix, line->len - prefix - 1);
+	if (!str)
+		return;
+
+	mqtt_phy_event(phy, str);
+	free(str);
+}
+#endif
+
+static void
+phy_event_emit(struct phy *phy, char *str, size_t len)
+{
+	struct rcd_event ev;
+
+	phy->stats.lines++;
+
+	phy_event_parse(&ev, phy, str, len);
+	phy_event_check_state(phy, &ev);
+
+	/* aggregation sees every txs event, before sampling */
+	if (ev.type == RCD_EV_TXS && !list_empty(&phy->txs_aggrs))
+		txs_aggr_event(phy, &ev);
+
+	if (rcd_sampler_enabled(&phy->sampler)) {
+		ev.scale = rcd_sample(&phy->sampler, &ev);
+		if (!ev.scale)
+			return;
+	}
+
+	phy->stats.forwarded++;
+	rcd_client_phy_event(&ev);
 #ifdef CONFIG_MQTT
-		mqtt_phy_event(phy, cur);
+	phy_event_mqtt(phy, &ev);
 #endif
+}
+
+/*
+ * Hand all complete lines in the ring to the consumers. Lines are passed
+ * in place and NUL-terminated by overwriting their newline. The only copy
+ * happens for the rare line that wraps around the end of the ring.
+ */
+static void
+phy_event_read_buf(struct phy *phy)
+{
+	struct phy_ring *r = &phy->ring;
+	size_t start, idx, len, n, head;
+	char *nl, *tmp;
+
+	/* head is advanced concurrently in threaded mode, see phy_thread.c */
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	while (r->scan != head) {
+		idx = r->scan % r->size;
+		n = head - r->scan;
+		if (n > r->size - idx)
+			n = r->size - idx;
+
+		nl = memchr(r->buf + idx, '\n', n);
+		if (!nl) {
+			r->scan += n;
+			continue;
+		}
+
+		*nl = 0;
+		r->scan += nl - (r->buf + idx) + 1;
+		len = r->scan - 1 - r->tail;
+		start = r->tail % r->size;
+
+		if (start + len < r->size) {
+			phy_event_emit(phy, r->buf + start, len);
+			__atomic_store_n(&r->tail, r->scan, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		tmp = malloc(len + 1);
+		if (!tmp)
+			continue;
+
+		n = r->size - start;
+		memcpy(tmp, r->buf + start, n);
+		memcpy(tmp + n, r->buf, len - n);
+		tmp[len] = 0;
+		__atomic_store_n(&r->tail, r->scan, __ATOMIC_RELEASE);
+		phy_event_emit(phy, tmp, len);
+		free(tmp);
 	}
+}
+
+/*
+ * A single line does not fit into the ring, drop it. It may have been a
+ * station change, so reload the station table and initial state on their
+ * next use.
+ */
+static void
+phy_ring_overflow(struct phy *phy)
+{
+	struct phy_ring *r = &phy->ring;
+
+	r->scan = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&r->tail, r->scan, __ATOMIC_RELEASE);
+	phy->stats.overflows++;
+	phy->stations_stale = true;
+	phy_snapshot_invalidate(&phy->state);
+}
 
-	len = strlen(cur);
-	if (cur > buf)
-		memmove(buf, cur, len + 1);
+/* dispatch the lines a reader thread put into the ring */
+void rcd_phy_ring_consume(struct phy *phy)
+{
+	struct phy_ring *r = &phy->ring;
 
-	return len;
+	phy_event_read_buf(phy);
+	if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail == r->size)
+		phy_ring_overflow(phy);
 }
 
 static void
 phy_event_cb(struct uloop_fd *fd, unsigned int events)
 {
 	struct phy *phy = container_of(fd, struct phy, event_fd);
-	char buf[512];
-	int len, offset = 0;
+	struct phy_ring *r = &phy->ring;
+	size_t idx, n;
+	ssize_t len;
+
+	phy->stats.wakeups++;
 
 	while (1) {
-		len = read(fd->fd, buf + offset, sizeof(buf) - 1 - offset);
+		if (r->head - r->tail == r->size)
+			phy_ring_overflow(phy);
+
+		idx = r->head % r->size;
+		n = r->size - (r->head - r->tail);
+		if (n > r->size - idx)
+			n = r->size - idx;
+
+		len = read(fd->fd, r->buf + idx, n);
 		if (len < 0) {
 			if (errno == EAGAIN)
 				return;
@@ -81,38 +544,63 @@ phy_event_cb(struct uloop_fd *fd, unsigned int events)
 		if (!len)
 			return;
 
-		buf[offset + len] = 0;
-		offset = phy_event_read_buf(phy, buf);
+		phy->stats.reads++;
+		phy->stats.bytes += len;
+		r->head += len;
+		phy_event_read_buf(phy);
 	}
 }
 
 static void
 phy_init(struct phy *phy)
 {
-	phy->control_fd = -1;
+	phy->control_fd.fd = -1;
+	INIT_LIST_HEAD(&phy->control_queue);
+	INIT_LIST_HEAD(&phy->txs_aggrs);
 }
 
 static void
 phy_add(struct phy *phy)
 {
+	static unsigned int next_id;
 	int cfd, efd;
 
-	cfd = open(phy_file_path(phy, "api_control"), O_WRONLY);
+	cfd = phy_open(phy, "api_control", O_WRONLY | O_NONBLOCK);
 	if (cfd < 0)
 		goto remove;
 
-	efd = open(phy_file_path(phy, "api_event"), O_RDONLY);
+	efd = phy_open(phy, "api_event", O_RDONLY);
 	if (efd < 0)
 		goto close_cfd;
 
-	phy->control_fd = cfd;
+	phy->ring.size = opts.event_bufsize;
+	phy->ring.buf = malloc(phy->ring.size);
+	if (!phy->ring.buf)
+		goto close_efd;
+
+	phy_stations_load(phy);
+	if (rcd_sampler_parse(&phy->sampler, opts.event_sample))
+		fprintf(stderr, "WARNING: invalid event_sample '%s'\n", opts.event_sample);
+
+#ifdef CONFIG_MQTT
+	phy->mqtt_aggr.cb = phy_mqtt_txs_summary;
+	if (opts.txs_summary_mqtt &&
+	    txs_aggr_attach(phy, &phy->mqtt_aggr, opts.txs_summary_mqtt))
+		fprintf(stderr, "WARNING: failed to enable txs summaries for MQTT\n");
+#endif
+
+	phy->id = next_id++;
+	phy->control_fd.fd = cfd;
 	phy->event_fd.fd = efd;
 	phy->event_fd.cb = phy_event_cb;
-	uloop_fd_add(&phy->event_fd, ULOOP_READ);
+	if (!rcd_phy_reader_start(phy, efd))
+		uloop_fd_add(&phy->event_fd, ULOOP_READ);
 
 	rcd_client_set_phy_state(NULL, phy, true);
 	return;
 
+close_efd:
+	close(efd);
 close_cfd:
 	close(cfd);
 remove:
@@ -122,13 +610,22 @@ remove:
 static void
 phy_remove(struct phy *phy)
 {
-	if (phy->control_fd < 0)
+	if (phy->control_fd.fd < 0)
 		goto out;
 
 	rcd_client_set_phy_state(NULL, phy, false);
+	rcd_phy_reader_stop(phy);
 	uloop_fd_delete(&phy->event_fd);
-	close(phy->control_fd);
+	rcd_phy_control_free(phy);
+	rcd_debugfs_poll_phy_free(phy);
+	close(phy->control_fd.fd);
 	close(phy->event_fd.fd);
+	free(phy->ring.buf);
+	phy_snapshot_invalidate(&phy->info);
+	phy_snapshot_invalidate(&phy->state);
+	mac_table_flush(&phy->stations, phy_sta_free);
+	rcd_sampler_free(&phy->sampler);
+	txs_aggr_phy_free(phy);
 
 out:
 	free(phy);
@@ -149,24 +646,41 @@ phy_update(struct vlist_tree *tree, struct vlist_node *node_new,
 		phy_remove(phy_old);
 }
 
-static void phy_refresh_timer(struct uloop_timeout *t)
+/*
+ * A backend may report the complete set of PHYs between rcd_phy_update_start()
+ * and rcd_phy_update_done(), PHYs not reported in between are removed.
+ */
+void rcd_phy_update_start(void)
 {
-	unsigned int i;
-	glob_t gl;
+	vlist_update(&phy_list);
+}
 
-	glob("/sys/class/ieee80211/*", 0, NULL, &gl);
-	for (i = 0; i < gl.gl_pathc; i++) {
-		struct phy *phy;
-		char *name, *name_buf;
+void rcd_phy_update_done(void)
+{
+	vlist_flush(&phy_list);
+}
+
+bool rcd_phy_add(const char *name)
+{
+	struct phy *phy;
+	char *name_buf;
 
-		name = basename(gl.gl_pathv[i]);
-		phy = calloc_a(sizeof(*phy), &name_buf, strlen(name) + 1);
-		phy_init(phy);
-		vlist_add(&phy_list, &phy->node, strcpy(name_buf, name));
+	phy = vlist_find(&phy_list, name, phy, node);
+	if (phy) {
+		/* known PHY, only mark it as still present */
+		phy->node.version = phy_list.version;
+		return true;
 	}
-	globfree(&gl);
 
-	uloop_timeout_set(t, 1000);
+	phy = calloc_a(sizeof(*phy), &name_buf, strlen(name) + 1);
+	if (!phy)
+		return false;
+
+	phy_init(phy);
+	vlist_add(&phy_list, &phy->node, strcpy(name_buf, name));
+
+	/* phy_add() drops the PHY again if its API files cannot be opened */
+	return !!vlist_find(&phy_list, name, phy, node);
 }
 
 void rcd_phy_init_client(struct client *cl)
@@ -177,22 +691,24 @@ void rcd_phy_init_client(struct client *cl)
 		rcd_client_set_phy_state(cl, phy, true);
 }
 
-void rcd_api_info_dump(struct client *cl, struct phy *phy)
+static void
+phy_fill_api_info(struct phy *phy, FILE *out)
 {
 	char buf[512];
 	FILE *f;
 
-	f = fopen(phy_file_path(phy, "api_info"), "r");
+	f = phy_fopen(phy, "api_info");
 	if (!f)
 		return;
 
 	while (fgets(buf, sizeof(buf), f) != NULL)
-		client_printf(cl, "*;0;%s", buf);
+		fprintf(out, "*;0;%s", buf);
 
 	fclose(f);
 }
 
-void rcd_phy_info(struct client *cl, struct phy *phy)
+static void
+phy_fill_state(struct phy *phy, FILE *out)
 {
 	char buf[256];
 	char caps[4][128] = { "", "", "", "" };
@@ -200,7 +716,7 @@ void rcd_phy_info(struct client *cl, struct phy *phy)
 	FILE *f;
 	int idx, max_len = 128;
 
-	f = fopen(phy_file_path(phy, "api_phy"), "r");
+	f = phy_fopen(phy, "api_phy");
 	if (!f)
 		return;
 
@@ -234,8 +750,8 @@ void rcd_phy_info(struct client *cl, struct phy *phy)
 		strncpy(caps[idx], value, max_len);
 	}
 
-	client_phy_printf(cl, phy, "0;add;%s;%s;%s;%s\n", caps[0],
-			  caps[2], caps[1], caps[3]);
+	fprintf(out, "%s;0;add;%s;%s;%s;%s\n", phy_name(phy), caps[0],
+		caps[2], caps[1], caps[3]);
 
 	if (!res)
 		goto out;
@@ -247,20 +763,117 @@ void rcd_phy_info(struct client *cl, struct phy *phy)
 		if (strncmp(buf, "if", 2) && strncmp(buf, "sta", 3))
 			continue;
 
-		client_phy_printf(cl, phy, "0;%s;add;%s", type, value);
+		fprintf(out, "%s;0;%s;add;%s", phy_name(phy), type, value);
 	} while (fgets(buf, sizeof(buf), f) != NULL);
 
 out:
 	fclose(f);
 }
 
+static struct rcd_line *
+phy_snapshot_build(struct phy *phy, void (*fill)(struct phy *phy, FILE *out))
+{
+	struct rcd_line *line = NULL;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out;
+
+	out = open_memstream(&buf, &len);
+	if (!out)
+		return NULL;
+
+	fill(phy, out);
+	if (fclose(out))
+		goto out;
+
+	line = rcd_line_alloc(len);
+	if (line)
+		memcpy(line->data, buf, len);
+
+out:
+	free(buf);
+	return line;
+}
+
+#ifdef CONFIG_ZSTD
+static struct rcd_line *
+phy_snapshot_compress(struct rcd_line *plain)
+{
+	struct rcd_line *line;
+	void *buf;
+	size_t len;
+
+	if (zstd_compress(plain->data, plain->len, &buf, &len))
+		return NULL;
+
+	line = rcd_line_alloc(len);
+	if (line)
+		memcpy(line->data, buf, len);
+
+	free(buf);
+	return line;
+}
+#endif
+
+/*
+ * The formatted initial state of a PHY is cached, together with a single zstd
+ * frame of it for compressed clients, so a connecting client only costs a
+ * buffer write. Both are built on first use after being invalidated.
+ */
+static struct rcd_line *
+phy_snapshot_get(struct phy *phy, struct phy_snapshot *snap,
+		 void (*fill)(struct phy *phy, FILE *out), bool compressed)
+{
+	if (!snap->plain)
+		snap->plain = phy_snapshot_build(phy, fill);
+
+	if (!snap->plain || !compressed)
+		return snap->plain;
+
+#ifdef CONFIG_ZSTD
+	if (!snap->zstd && snap->plain->len)
+		snap->zstd = phy_snapshot_compress(snap->plain);
+#endif
+
+	return snap->zstd;
+}
+
+static void
+phy_snapshot_write(struct client *cl, struct phy *phy, struct phy_snapshot *snap,
+		   void (*fill)(struct phy *phy, FILE *out))
+{
+	struct rcd_line *line;
+
+	line = phy_snapshot_get(phy, snap, fill, cl->compression);
+	if (!line || !line->len)
+		return;
+
+	if (cl->binary) {
+		rcd_bin_text(cl, line->data, line->len);
+		return;
+	}
+
+	client_zstd_private(cl);
+	client_write_line(cl, line, CLIENT_LINE_PROTECTED, NULL, NULL);
+}
+
+void rcd_api_info_dump(struct client *cl, struct phy *phy)
+{
+	phy_snapshot_write(cl, phy, &phy->info, phy_fill_api_info);
+}
+
+void rcd_phy_info(struct client *cl, struct phy *phy)
+{
+	phy_snapshot_write(cl, phy, &phy->state, phy_fill_state);
+}
+
 #ifdef CONFIG_MQTT
 void mqtt_phy_dump(struct phy *phy, int (*cb)(void*, char*), void *cb_arg)
 {
 	char buf[512];
 	FILE *f;
 
-	f = fopen(phy_file_path(phy, "api_info"), "r");
+	f = phy_fopen(phy, "api_info");
 	if (!f)
 		return;
 
@@ -274,12 +887,19 @@ void mqtt_phy_dump(struct phy *phy, int (*cb)(void*, char*), void *cb_arg)
 static int
 phy_fd_write(int fd, const char *s)
 {
-retry:
-	if (write(fd, s, strlen(s)) < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			goto retry;
+	size_t len = strlen(s);
+	ssize_t ret;
 
-		return errno;
+	while (len) {
+		ret = write(fd, s, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return errno;
+
+		s += ret;
+		len -= ret;
 	}
 
 	return 0;
@@ -291,7 +911,7 @@ phy_debugfs_read(struct client *cl, struct phy *phy, const char *file)
 	char *buf, *cur;
 	int fd, len, err = 0, offset = 0, bufsiz = 512;
 
-	fd = open(phy_debugfs_file_path(phy, file), O_RDONLY);
+	fd = phy_debugfs_open(phy, file, O_RDONLY);
 	if (fd < 0)
 		return errno;
 
@@ -343,12 +963,151 @@ error:
 	return err;
 }
 
+static void
+phy_debugfs_chunk(struct client *cl, struct phy *phy, unsigned long long ts, const char *file,
+		  char *buf, size_t len)
+{
+	size_t i;
+
+	if (len && buf[len - 1] == '\n')
+		len--;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] == '\n')
+			buf[i] = ',';
+
+	client_phy_printf(cl, phy, "%llx;debugfs_data;%s;%.*s\n", ts, file, (int) len, buf);
+}
+
+/*
+ * Read a file and send it in chunks of complete lines of up to
+ * DEBUGFS_CHUNK bytes, followed by the number of bytes and the time the
+ * read took, so that the file is never held in memory as a whole.
+ */
+static int
+phy_debugfs_stream(struct client *cl, struct phy *phy, const char *file)
+{
+	unsigned long long ts, time;
+	char buf[DEBUGFS_CHUNK];
+	size_t len = 0, total = 0, n;
+	struct timespec now;
+	ssize_t ret;
+	int fd, err = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	fd = phy_debugfs_open(phy, file, O_RDONLY);
+	if (fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	while (1) {
+		ret = read(fd, buf + len, sizeof(buf) - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0) {
+			err = errno;
+			break;
+		}
+
+		len += ret;
+		total += ret;
+
+		/* keep an incomplete line for the next chunk, unless it fills it */
+		n = len;
+		if (ret) {
+			while (n && buf[n - 1] != '\n')
+				n--;
+			if (!n && len == sizeof(buf))
+				n = len;
+		}
+
+		if (n) {
+			phy_debugfs_chunk(cl, phy, ts, file, buf, n);
+			memmove(buf, buf + n, len - n);
+			len -= n;
+		}
+
+		if (!ret)
+			break;
+	}
+
+	close(fd);
+
+out:
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time = now.tv_sec * 1000000000ULL + now.tv_nsec - ts;
+	client_phy_printf(cl, phy, "%llx;debugfs_end;%s;%zx;%llx%s%s\n", ts, file, total, time,
+			  err ? ";" : "", err ? strerror(err) : "");
+
+	return err;
+}
+
+static bool
+phy_debugfs_path_valid(const char *path)
+{
+	/* Make sure path cannot contain dots as this would expose the entire
+	 * file system to unauthorized write access if path is something like
+	 * '../../../../' ...
+	 * Also, limit path length to 64 chars as a precaution.
+	 */
+	return path && *path && !strchr(path, '.') && strlen(path) <= 64;
+}
+
+/*
+ * <path>;<path>;... for a PHY, or <phy>/<path>;... for '*'. All entries are
+ * checked before the files are read back to back.
+ */
+static int
+phy_debugfs_batch(struct client *cl, struct phy *phy, char *args)
+{
+	struct {
+		struct phy *phy;
+		const char *path;
+	} files[DEBUGFS_BATCH_MAX];
+	unsigned int i, n = 0;
+	char *entry, *name;
+	int err, ret = 0;
+
+	while ((entry = strsep(&args, ";")) != NULL) {
+		if (n == ARRAY_SIZE(files))
+			return E2BIG;
+
+		files[n].phy = phy;
+		if (!phy) {
+			name = strsep(&entry, "/");
+			files[n].phy = vlist_find(&phy_list, name, files[n].phy, node);
+			if (!files[n].phy)
+				return ENODEV;
+		}
+
+		if (!phy_debugfs_path_valid(entry))
+			return EINVAL;
+
+		files[n++].path = entry;
+	}
+
+	if (!n)
+		return EINVAL;
+
+	for (i = 0; i < n; i++) {
+		err = phy_debugfs_stream(cl, files[i].phy, files[i].path);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
+
 static int
 phy_debugfs_write(struct phy *phy, const char *file, const char *arg)
 {
 	int err, fd;
 
-	fd = open(phy_debugfs_file_path(phy, file), O_WRONLY);
+	fd = phy_debugfs_open(phy, file, O_WRONLY);
 	if (fd < 0)
 		return errno;
 
@@ -380,7 +1139,7 @@ __get_args(char **dest, int dest_size, char *str, char *sep)
 static int
 phy_debugfs_monitor(struct client *cl, struct phy *phy, const char *file, char *args)
 {
-	int nargs, port, err;
+	int nargs, port, fd, err;
 	char *argv[3];
 	size_t bufsize = 0;
 	unsigned int timeout = 0;
@@ -399,8 +1158,11 @@ phy_debugfs_monitor(struct client *cl, struct phy *phy, const char *file, char *
 		timeout = atoi(argv[2]);
 	}
 
-	err = rcd_debugfs_monitoring_start(phy_debugfs_file_path(phy, file), port, bufsize, timeout,
-	                        	   compression);
+	fd = phy_debugfs_open(phy, file, O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	err = rcd_debugfs_monitoring_start(fd, port, bufsize, timeout, compression);
 	if (err)
 		return err;
 
@@ -409,15 +1171,22 @@ phy_debugfs_monitor(struct client *cl, struct phy *phy, const char *file, char *
 	return 0;
 }
 
+static int
+phy_debugfs_poll(struct client *cl, struct phy *phy, const char *file, char *args)
+{
+	int fd;
+
+	fd = phy_debugfs_open(phy, file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+
+	return rcd_debugfs_poll(cl, phy, fd, file, args);
+}
+
 static int
 phy_debugfs(struct client *cl, struct phy *phy, char *cmd, const char *path, char *args)
 {
-	/* Make sure path cannot contain dots as this would expose the entire
-	 * file system to unauthorized write access if path is something like
-	 * '../../../../' ...
-	 * Also, limit path length to 64 chars as a precaution.
-	 */
-	if (!path || strchr(path, '.') || strlen(path) > 64)
+	if (!phy_debugfs_path_valid(path))
 		return -EINVAL;
 
 	if (strcmp(cmd, "debugfs") == 0) {
@@ -427,19 +1196,189 @@ phy_debugfs(struct client *cl, struct phy *phy, char *cmd, const char *path, cha
 			return phy_debugfs_read(cl, phy, path);
 	} else if (strcmp(cmd, "debugfs_monitor") == 0) {
 		return phy_debugfs_monitor(cl, phy, path, args);
+	} else if (strcmp(cmd, "debugfs_poll") == 0) {
+		return phy_debugfs_poll(cl, phy, path, args);
 	} else {
 		return -EINVAL;
 	}
 }
 
+static int
+phy_cmd_event_stats(struct client *cl, struct phy *phy, char *args)
+{
+	/* wakeups, reads and bytes may be updated by the reader thread */
+	uint64_t wakeups = __atomic_load_n(&phy->stats.wakeups, __ATOMIC_RELAXED);
+	uint64_t reads = __atomic_load_n(&phy->stats.reads, __ATOMIC_RELAXED);
+	uint64_t bytes = __atomic_load_n(&phy->stats.bytes, __ATOMIC_RELAXED);
+
+	client_phy_printf(cl, phy, "0;event_stats;%llu;%llu;%llu;%llu;%llu;%.2f;%.2f\n",
+			  (unsigned long long) wakeups,
+			  (unsigned long long) reads,
+			  (unsigned long long) phy->stats.lines,
+			  (unsigned long long) bytes,
+			  (unsigned long long) phy->stats.overflows,
+			  wakeups ? (double) reads / wakeups : 0,
+			  reads ? (double) phy->stats.lines / reads : 0);
+	return 0;
+}
+
+static int
+phy_cmd_stations(struct client *cl, struct phy *phy, char *args)
+{
+	struct mac_entry *e;
+	struct phy_sta *sta;
+	unsigned int i;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out;
+
+	if (phy->stations_stale)
+		phy_stations_load(phy);
+
+	/* answer with a single write, so compressed clients get one frame */
+	out = open_memstream(&buf, &len);
+	if (!out)
+		return ENOMEM;
+
+	fprintf(out, "%s;0;stations;%x\n", phy_name(phy), phy->stations.count);
+	mac_table_for_each(&phy->stations, e, i) {
+		sta = container_of(e, struct phy_sta, node);
+		fprintf(out, "%s;0;station;" MAC_FMT ";%s\n", phy_name(phy),
+			MAC_ARG(e->addr), sta->info);
+	}
+
+	if (fclose(out)) {
+		free(buf);
+		return ENOMEM;
+	}
+
+	client_send(cl, buf, len);
+	free(buf);
+
+	return 0;
+}
+
+static inline bool
+phy_rc_state_match(struct phy_sta *sta, const uint8_t *addr)
+{
+	return sta->applied && (!addr || !memcmp(sta->node.addr, addr, 6));
+}
+
+/* [<macaddr>] */
+static int
+phy_cmd_rc_state(struct client *cl, struct phy *phy, char *args)
+{
+	const uint8_t *filter = NULL;
+	struct mac_entry *e;
+	struct phy_sta *sta;
+	uint8_t addr[6];
+	unsigned int i, n = 0;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out;
+
+	if (args && *args) {
+		if (!mac_parse(args, addr))
+			return EINVAL;
+		filter = addr;
+	}
+
+	mac_table_for_each(&phy->stations, e, i)
+		if (phy_rc_state_match(container_of(e, struct phy_sta, node), filter))
+			n++;
+
+	/* answer with a single write, so compressed clients get one frame */
+	out = open_memstream(&buf, &len);
+	if (!out)
+		return ENOMEM;
+
+	fprintf(out, "%s;0;rc_state;%llu;%llu;%llu;%x\n", phy_name(phy),
+		(unsigned long long) phy->control_stats.written,
+		(unsigned long long) phy->control_stats.skipped,
+		(unsigned long long) phy->control_stats.coalesced, n);
+	mac_table_for_each(&phy->stations, e, i) {
+		sta = container_of(e, struct phy_sta, node);
+		if (phy_rc_state_match(sta, filter))
+			fprintf(out, "%s;0;rc_sta;" MAC_FMT ";%s\n", phy_name(phy),
+				MAC_ARG(e->addr), sta->applied);
+	}
+
+	if (fclose(out)) {
+		free(buf);
+		return ENOMEM;
+	}
+
+	client_send(cl, buf, len);
+	free(buf);
+
+	return 0;
+}
+
+static int
+phy_cmd_event_sample(struct client *cl, struct phy *phy, char *args)
+{
+	struct rcd_sampler sampler;
+	int err;
+
+	err = rcd_sampler_parse(&sampler, args);
+	if (err)
+		return err;
+
+	rcd_sampler_free(&phy->sampler);
+	phy->sampler = sampler;
+
+	return 0;
+}
+
+/* commands handled by orca-rcd itself instead of being passed to api_control */
+static const struct phy_cmd {
+	const char *name;
+	int (*cb)(struct client *cl, struct phy *phy, char *args);
+	/* called once with phy == NULL for the '*' wildcard */
+	bool wildcard;
+} phy_cmds[] = {
+	{ "event_stats", phy_cmd_event_stats, false },
+	{ "stations", phy_cmd_stations, false },
+	{ "event_sample", phy_cmd_event_sample, false },
+	{ "rc_state", phy_cmd_rc_state, false },
+	{ "subscribe", rcd_client_subscribe, true },
+	{ "unsubscribe", rcd_client_unsubscribe, true },
+	{ "project", rcd_client_project, true },
+	{ "sample", rcd_client_sample, true },
+	{ "txs_summary", rcd_client_txs_summary, false },
+	{ "stats", rcd_stats_cmd, true },
+};
+
+static const struct phy_cmd *
+phy_cmd_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(phy_cmds); i++)
+		if (!strcmp(phy_cmds[i].name, name))
+			return &phy_cmds[i];
+
+	return NULL;
+}
+
 void rcd_phy_control(struct client *cl, char *data)
 {
+	const struct phy_cmd *pcmd;
+	struct rcd_request req;
 	struct phy *phy = NULL;
 	const char *err = "Syntax error";
 	char *sep, *cmd, *path;
 	int error = 0;
 	bool wildcard;
 
+	rcd_stats.commands++;
+	data = rcd_request_parse(&req, data);
+	if (!data) {
+		rcd_stats.command_errors++;
+		client_printf(cl, "*;0;#error;%s\n", err);
+		return;
+	}
+
 	sep = strchr(data, ';');
 	if (!sep)
 		goto error;
@@ -461,6 +1400,12 @@ void rcd_phy_control(struct client *cl, char *data)
 	if (sep) {
 		*sep = 0;
 		cmd = data;
+		if (strcmp(cmd, "debugfs_batch") == 0) {
+			error = phy_debugfs_batch(cl, phy, sep + 1);
+			rcd_phy_control_result(cl, phy, &req, error);
+			return;
+		}
+
 		if (strncmp(cmd, "debugfs", 7) == 0) {
 			if (wildcard) {
 				err = "Cannot use debugfs with wildcard phy";
@@ -469,42 +1414,63 @@ void rcd_phy_control(struct client *cl, char *data)
 			data = sep + 1;
 			path = strsep(&data, ";");
 			error = phy_debugfs(cl, phy, cmd, path, data);
-			if (error) {
-				err = strerror(error);
-				goto error;
-			}
+			rcd_phy_control_result(cl, phy, &req, error);
 			return;
 		}
 		*sep = ';';
 	}
 
+	sep = strchr(data, ';');
+	if (sep)
+		*sep = 0;
+	pcmd = phy_cmd_find(data);
+	if (sep)
+		*sep++ = ';';
+
+	if (pcmd && (!wildcard || pcmd->wildcard)) {
+		error = pcmd->cb(cl, phy, sep);
+		rcd_phy_control_result(cl, phy, &req, error);
+		return;
+	}
+
+	/* a wildcard command is issued to every PHY, each with a result of its own */
 	if (wildcard) {
 		vlist_for_each_element(&phy_list, phy, node) {
-			error = phy_fd_write(phy->control_fd, data);
-			if (error) {
-				err = strerror(error);
-				goto error;
-			}
-		}
-	} else {
-		error = phy_fd_write(phy->control_fd, data);
-		if (error) {
-			err = strerror(error);
-			goto error;
+			if (pcmd)
+				rcd_phy_control_result(cl, phy, &req, pcmd->cb(cl, phy, sep));
+			else
+				rcd_phy_control_write(cl, phy, &req, data);
 		}
+		return;
 	}
 
+	rcd_phy_control_write(cl, phy, &req, data);
 	return;
 
 error:
-	client_printf(cl, "*;0;#error;%s\n", err);
+	rcd_request_reply(cl, NULL, &req, err);
 }
 
-void rcd_phy_init(void)
+int rcd_phy_init(const struct phy_opts *o)
 {
-	static struct uloop_timeout t = {
-		.cb = phy_refresh_timer
-	};
+	unsigned int i;
+
+	opts = *o;
+	rcd_phy_control_init(o->control_queue, o->control_coalesce);
+
+	if (rcd_phy_reader_init(o->ingest_threads, o->ingest_cpus)) {
+		fprintf(stderr, "ERROR: invalid ingest CPU list '%s'\n", o->ingest_cpus);
+		return -1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(backends); i++) {
+		if (strcmp(backends[i]->name, o->backend) != 0)
+			continue;
+
+		backend = backends[i];
+		return backend->init(o);
+	}
 
-	uloop_timeout_set(&t, 1);
+	fprintf(stderr, "ERROR: unknown PHY backend '%s'\n", o->backend);
+	return -1;
 }
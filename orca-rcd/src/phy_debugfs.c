@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021 Felix Fietkau <nbd@nbd.name> */
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <glob.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include "rcd.h"
+
+/* PHY backend for the ORCA API as exported by the kernel through debugfs */
+
+enum discovery {
+	DISCOVERY_UEVENT,
+	DISCOVERY_INOTIFY,
+	DISCOVERY_POLL,
+};
+
+static const char *debugfs_root;
+static const char *sysfs_root;
+static enum discovery discovery;
+static struct uloop_fd discovery_fd;
+static struct uloop_timeout scan_timer;
+
+static int
+debugfs_open(struct phy *phy, const char *file, int flags)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/rc/%s", debugfs_root, phy_name(phy), file);
+
+	return open(path, flags);
+}
+
+static int
+debugfs_debugfs_open(struct phy *phy, const char *file, int flags)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/%s", debugfs_root, phy_name(phy), file);
+
+	return open(path, flags);
+}
+
+/*
+ * Rescan the PHYs in sysfs_root. This only runs when a discovery event was
+ * received or, with polling discovery, once per second. If a PHY shows up
+ * before its debugfs files are ready, the scan is retried after a second.
+ */
+static void
+debugfs_scan(void)
+{
+	char pattern[PATH_MAX];
+	unsigned int i;
+	bool retry = false;
+	glob_t gl;
+
+	snprintf(pattern, sizeof(pattern), "%s/*", sysfs_root);
+	glob(pattern, 0, NULL, &gl);
+
+	rcd_phy_update_start();
+	for (i = 0; i < gl.gl_pathc; i++)
+		if (!rcd_phy_add(basename(gl.gl_pathv[i])))
+			retry = true;
+	rcd_phy_update_done();
+
+	globfree(&gl);
+
+	if (discovery == DISCOVERY_POLL || retry)
+		uloop_timeout_set(&scan_timer, 1000);
+}
+
+static void
+debugfs_scan_timer(struct uloop_timeout *t)
+{
+	debugfs_scan();
+}
+
+static void
+debugfs_uevent_cb(struct uloop_fd *fd, unsigned int events)
+{
+	char buf[4096], *cur, *end;
+	bool rescan = false;
+	ssize_t len;
+
+	while (1) {
+		len = recv(fd->fd, buf, sizeof(buf) - 1, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* the socket buffer overflowed and events were lost */
+			if (errno == ENOBUFS)
+				rescan = true;
+
+			break;
+		}
+
+		buf[len] = 0;
+		end = buf + len;
+		for (cur = buf; cur < end; cur += strlen(cur) + 1) {
+			if (!strcmp(cur, "SUBSYSTEM=ieee80211")) {
+				rescan = true;
+				break;
+			}
+		}
+	}
+
+	if (rescan)
+		debugfs_scan();
+}
+
+static int
+debugfs_uevent_init(void)
+{
+	struct sockaddr_nl nl = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *) &nl, sizeof(nl))) {
+		close(fd);
+		return -1;
+	}
+
+	discovery_fd.fd = fd;
+	discovery_fd.cb = debugfs_uevent_cb;
+	uloop_fd_add(&discovery_fd, ULOOP_READ);
+
+	return 0;
+}
+
+static void
+debugfs_inotify_cb(struct uloop_fd *fd, unsigned int events)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool rescan = false;
+	ssize_t len;
+
+	while ((len = read(fd->fd, buf, sizeof(buf))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* any change of the directory triggers a rescan */
+		rescan = true;
+	}
+
+	if (rescan)
+		debugfs_scan();
+}
+
+static int
+debugfs_inotify_init(void)
+{
+	int fd;
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (inotify_add_watch(fd, sysfs_root, IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+					      IN_MOVED_TO | IN_ONLYDIR) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	discovery_fd.fd = fd;
+	discovery_fd.cb = debugfs_inotify_cb;
+	uloop_fd_add(&discovery_fd, ULOOP_READ);
+
+	return 0;
+}
+
+static int
+debugfs_init(const struct phy_opts *o)
+{
+	static const char * const discovery_names[] = {
+		[DISCOVERY_UEVENT] = "uevent",
+		[DISCOVERY_INOTIFY] = "inotify",
+		[DISCOVERY_POLL] = "poll",
+	};
+	bool is_auto = !strcmp(o->discovery, "auto");
+
+	debugfs_root = o->debugfs_root;
+	sysfs_root = o->sysfs_root;
+	scan_timer.cb = debugfs_scan_timer;
+	discovery = DISCOVERY_POLL;
+
+	/*
+	 * sysfs does not report new devices through inotify, use kernel
+	 * uevents for it and inotify for anything else (e.g. a tree on tmpfs).
+	 */
+	if (is_auto ? !strncmp(sysfs_root, "/sys/", 5) : !strcmp(o->discovery, "uevent")) {
+		discovery = DISCOVERY_UEVENT;
+		if (!debugfs_uevent_init())
+			goto out;
+	} else if (is_auto || !strcmp(o->discovery, "inotify")) {
+		discovery = DISCOVERY_INOTIFY;
+		if (!debugfs_inotify_init())
+			goto out;
+	} else if (strcmp(o->discovery, "poll") != 0) {
+		fprintf(stderr, "ERROR: unknown PHY discovery method '%s'\n", o->discovery);
+		return -1;
+	}
+
+	if (discovery != DISCOVERY_POLL)
+		fprintf(stderr, "WARNING: %s PHY discovery not available (%s), falling back to polling\n",
+			discovery_names[discovery], strerror(errno));
+
+	discovery = DISCOVERY_POLL;
+
+out:
+	debugfs_scan();
+	return 0;
+}
+
+const struct phy_backend phy_debugfs_backend = {
+	.name = "debugfs",
+	.init = debugfs_init,
+	.open = debugfs_open,
+	.debugfs_open = debugfs_debugfs_open,
+};
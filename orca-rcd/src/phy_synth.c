@@ -0,0 +1,334 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include "rcd.h"
+
+/*
+ * Synthetic PHY backend. It emulates a configurable number of PHYs with a
+ * fixed set of stations and generates txs/rxs/stats/sta events at a fixed
+ * rate, so orca-rcd can be load-tested and profiled without the ORCA kernel
+ * API. Events are written into a pipe per PHY, which makes them travel the
+ * same ingest path as lines read from a real api_event file.
+ */
+
+#define SYNTH_TICK_MS		10
+#define SYNTH_PIPE_SIZE		(1 << 20)
+#define SYNTH_BUF_SIZE		(1 << 16)
+
+struct synth_phy {
+	char name[16];
+	unsigned int idx;
+	int event_fd;
+	double carry;
+	size_t pos;
+	char buf[SYNTH_BUF_SIZE];
+};
+
+static struct synth_phy *synth_phys;
+static unsigned int n_phys, n_stations, rate;
+static struct uloop_timeout tick;
+static uint64_t last_tick;
+static uint32_t rng = 0x2545f491;
+
+static uint32_t
+synth_rand(void)
+{
+	/* xorshift32, the generated stream only needs to look plausible */
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static uint64_t
+synth_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *
+synth_sta_mac(struct synth_phy *sp, unsigned int sta)
+{
+	static char mac[18];
+
+	snprintf(mac, sizeof(mac), "02:00:00:%02x:%02x:%02x", sp->idx & 0xff,
+		 (sta >> 8) & 0xff, sta & 0xff);
+	return mac;
+}
+
+static struct synth_phy *
+synth_phy_get(struct phy *phy)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_phys; i++)
+		if (!strcmp(synth_phys[i].name, phy_name(phy)))
+			return &synth_phys[i];
+
+	return NULL;
+}
+
+static int
+synth_event_line(struct synth_phy *sp, char *buf, size_t len, uint64_t ts)
+{
+	const char *mac = synth_sta_mac(sp, synth_rand() % n_stations);
+	uint32_t r = synth_rand();
+	unsigned int nf, type = r % 100;
+
+	if (type < 80) {
+		nf = 1 + (r >> 8) % 4;
+		return snprintf(buf, len, "%llx;txs;%s;%x;%x;%x;%x,%x,%x;%x,%x,%x;,,;,,\n",
+				(unsigned long long) ts, mac, nf, (r >> 12) % (nf + 1),
+				!((r >> 16) % 20), 0x260 + (r >> 20) % 32, 1 + (r >> 25) % 3,
+				0x1f, 0x250 + (r >> 20) % 32, 1 + (r >> 27) % 2, 0x21);
+	} else if (type < 95) {
+		return snprintf(buf, len, "%llx;rxs;%s;%d;%d,%d,,\n",
+				(unsigned long long) ts, mac, -40 - (int) ((r >> 8) % 40),
+				-42 - (int) ((r >> 16) % 40), -44 - (int) ((r >> 24) % 40));
+	} else if (type < 99) {
+		return snprintf(buf, len, "%llx;stats;%s;%x;%x;%x;%x;%x\n",
+				(unsigned long long) ts, mac, 0x260 + (r >> 8) % 32,
+				(r >> 13) % 1000, (r >> 23) % 0x100, (r >> 10) % 0x400,
+				(r >> 20) % 0x400);
+	}
+
+	return snprintf(buf, len, "%llx;sta;update;%s;3c;18;ff;ff;ff;ff\n",
+			(unsigned long long) ts, mac);
+}
+
+static void
+synth_phy_flush(struct synth_phy *sp)
+{
+	ssize_t len;
+
+	if (sp->event_fd < 0 || !sp->pos)
+		return;
+
+	len = write(sp->event_fd, sp->buf, sp->pos);
+	if (len <= 0)
+		return;
+
+	sp->pos -= len;
+	memmove(sp->buf, sp->buf + len, sp->pos);
+}
+
+static void
+synth_tick(struct uloop_timeout *t)
+{
+	struct synth_phy *sp;
+	uint64_t now = synth_now();
+	double due;
+	unsigned int i, n;
+	int len;
+
+	for (i = 0; i < n_phys; i++) {
+		sp = &synth_phys[i];
+		due = (double) rate * (now - last_tick) / 1e9 + sp->carry;
+		n = due;
+		sp->carry = due - n;
+
+		if (sp->event_fd < 0)
+			continue;
+
+		while (n--) {
+			len = synth_event_line(sp, sp->buf + sp->pos,
+					       sizeof(sp->buf) - sp->pos, now);
+			if (len >= (int) (sizeof(sp->buf) - sp->pos))
+				break;
+
+			sp->pos += len;
+		}
+
+		synth_phy_flush(sp);
+	}
+
+	last_tick = now;
+	uloop_timeout_set(t, SYNTH_TICK_MS);
+}
+
+static int
+synth_memfd(const char *name, const char *data, size_t len)
+{
+	int fd;
+
+	fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, data, len) != (ssize_t) len || lseek(fd, 0, SEEK_SET) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+synth_file_fd(const char *name, void (*fill)(struct synth_phy *sp, FILE *f),
+	      struct synth_phy *sp)
+{
+	char *data;
+	size_t len;
+	FILE *f;
+	int fd;
+
+	f = open_memstream(&data, &len);
+	if (!f)
+		return -1;
+
+	fill(sp, f);
+	fclose(f);
+
+	fd = synth_memfd(name, data, len);
+	free(data);
+
+	return fd;
+}
+
+static void
+synth_fill_api_info(struct synth_phy *sp, FILE *f)
+{
+	fprintf(f, "#version;3\n"
+		   "#start;iface;txs,rxs,stats\n"
+		   "#stop;iface\n"
+		   "#set_rates;macaddr;rate,count,txpwr;...\n"
+		   "#set_power;macaddr;txpwr;...\n"
+		   "#set_rates_power;macaddr;rate,count,txpwr;...\n");
+}
+
+static void
+synth_fill_api_phy(struct synth_phy *sp, FILE *f)
+{
+	unsigned int i;
+
+	fprintf(f, "drv;synth\n"
+		   "tpc;pkt;1;0,20,e0,2\n"
+		   "ftrs;2;tpc,0;force-rr,0\n"
+		   "pwr_limit;2e\n"
+		   "if;%s-ap0;txs,rxs\n", sp->name);
+
+	for (i = 0; i < n_stations; i++)
+		fprintf(f, "sta;%s;3c;18;ff;ff;ff;ff\n", synth_sta_mac(sp, i));
+}
+
+static void
+synth_fill_debugfs(struct synth_phy *sp, FILE *f)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_stations; i++)
+		fprintf(f, "%s;%x;%x\n", synth_sta_mac(sp, i), synth_rand() % 1000,
+			synth_rand() % 1000);
+}
+
+static int
+synth_event_fd(struct synth_phy *sp)
+{
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC))
+		return -1;
+
+	fcntl(fds[1], F_SETPIPE_SZ, SYNTH_PIPE_SIZE);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+	if (sp->event_fd >= 0)
+		close(sp->event_fd);
+
+	sp->event_fd = fds[1];
+	sp->pos = 0;
+
+	return fds[0];
+}
+
+static int
+synth_open(struct phy *phy, const char *file, int flags)
+{
+	struct synth_phy *sp = synth_phy_get(phy);
+
+	if (!sp) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if ((flags & O_ACCMODE) != O_RDONLY)
+		return open("/dev/null", flags);
+
+	if (!strcmp(file, "api_event"))
+		return synth_event_fd(sp);
+	else if (!strcmp(file, "api_info"))
+		return synth_file_fd(file, synth_fill_api_info, sp);
+	else if (!strcmp(file, "api_phy"))
+		return synth_file_fd(file, synth_fill_api_phy, sp);
+
+	errno = ENOENT;
+	return -1;
+}
+
+static int
+synth_debugfs_open(struct phy *phy, const char *file, int flags)
+{
+	struct synth_phy *sp = synth_phy_get(phy);
+
+	if (!sp) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if ((flags & O_ACCMODE) != O_RDONLY)
+		return open("/dev/null", flags);
+
+	return synth_file_fd(file, synth_fill_debugfs, sp);
+}
+
+static int
+synth_init(const struct phy_opts *o)
+{
+	unsigned int i;
+
+	n_phys = o->synth_phys;
+	n_stations = o->synth_stations;
+	rate = o->synth_rate;
+
+	if (!n_phys || !n_stations) {
+		fprintf(stderr, "ERROR: synthetic backend needs at least one PHY and station\n");
+		return -1;
+	}
+
+	synth_phys = calloc(n_phys, sizeof(*synth_phys));
+	if (!synth_phys)
+		return -ENOMEM;
+
+	for (i = 0; i < n_phys; i++) {
+		synth_phys[i].idx = i;
+		synth_phys[i].event_fd = -1;
+		snprintf(synth_phys[i].name, sizeof(synth_phys[i].name), "phy%u", i);
+		rcd_phy_add(synth_phys[i].name);
+	}
+
+	printf("synthetic backend: %u PHYs, %u stations, %u events/s per PHY\n",
+	       n_phys, n_stations, rate);
+
+	last_tick = synth_now();
+	tick.cb = synth_tick;
+	uloop_timeout_set(&tick, SYNTH_TICK_MS);
+
+	return 0;
+}
+
+const struct phy_backend phy_synth_backend = {
+	.name = "synthetic",
+	.init = synth_init,
+	.open = synth_open,
+	.debugfs_open = synth_debugfs_open,
+};
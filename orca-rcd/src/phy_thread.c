@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include "rcd.h"
+
+/*
+ * Threaded api_event ingest. A PHY with a reader thread has its api_event
+ * drained by that thread into the PHY's ring, which then acts as a lock-free
+ * single-producer/single-consumer queue: the thread only advances ring.head,
+ * the uloop thread only ring.tail/ring.scan. The uloop thread is woken
+ * through an eventfd, at most once per batch of reads, and splits and
+ * dispatches the lines as in the unthreaded mode. If the ring is full, the
+ * thread waits until the uloop thread has made room.
+ */
+struct phy_reader {
+	struct phy *phy;
+	pthread_t thread;
+	int event_fd;
+
+	/* reader -> uloop: data available or read error */
+	struct uloop_fd notify;
+	/* uloop -> reader: room in the ring or stop request */
+	int wake_fd;
+
+	int cpu;
+	bool pending;
+	bool full;
+	bool error;
+	bool stop;
+};
+
+static int *reader_cpus;
+static unsigned int n_reader_cpus, n_readers, n_started;
+
+static inline void
+reader_signal(int fd)
+{
+	uint64_t val = 1;
+
+	if (write(fd, &val, sizeof(val)) < 0)
+		return;
+}
+
+static inline void
+reader_clear(int fd)
+{
+	uint64_t val;
+
+	if (read(fd, &val, sizeof(val)) < 0)
+		return;
+}
+
+static void
+reader_notify(struct phy_reader *rd)
+{
+	/* only the first batch after the uloop thread caught up needs a wakeup */
+	if (!__atomic_exchange_n(&rd->pending, true, __ATOMIC_SEQ_CST))
+		reader_signal(rd->notify.fd);
+}
+
+/* wait for api_event data or a wakeup from the uloop thread */
+static void
+reader_wait(struct phy_reader *rd, bool data)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = rd->wake_fd, .events = POLLIN },
+		{ .fd = rd->event_fd, .events = POLLIN },
+	};
+
+	if (poll(pfd, data ? 2 : 1, -1) < 0)
+		return;
+
+	if (pfd[0].revents & POLLIN)
+		reader_clear(rd->wake_fd);
+}
+
+static void *
+reader_thread(void *arg)
+{
+	struct phy_reader *rd = arg;
+	struct phy *phy = rd->phy;
+	struct phy_ring *r = &phy->ring;
+	size_t head = r->head, tail, idx, n;
+	ssize_t len;
+
+	while (!__atomic_load_n(&rd->stop, __ATOMIC_ACQUIRE)) {
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head - tail == r->size) {
+			__atomic_store_n(&rd->full, true, __ATOMIC_SEQ_CST);
+
+			/* the uloop thread may have made room in the meantime */
+			if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == tail) {
+				reader_signal(rd->notify.fd);
+				reader_wait(rd, false);
+			}
+			continue;
+		}
+
+		idx = head % r->size;
+		n = r->size - (head - tail);
+		if (n > r->size - idx)
+			n = r->size - idx;
+
+		len = read(rd->event_fd, r->buf + idx, n);
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0 && errno != EAGAIN) {
+			__atomic_store_n(&rd->error, true, __ATOMIC_RELEASE);
+			reader_signal(rd->notify.fd);
+			break;
+		}
+
+		if (len <= 0) {
+			__atomic_fetch_add(&phy->stats.wakeups, 1, __ATOMIC_RELAXED);
+			reader_wait(rd, true);
+			continue;
+		}
+
+		__atomic_fetch_add(&phy->stats.reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&phy->stats.bytes, len, __ATOMIC_RELAXED);
+		head += len;
+		__atomic_store_n(&r->head, head, __ATOMIC_SEQ_CST);
+		reader_notify(rd);
+	}
+
+	return NULL;
+}
+
+static void
+reader_notify_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct phy_reader *rd = container_of(fd, struct phy_reader, notify);
+	struct phy *phy = rd->phy;
+
+	reader_clear(fd->fd);
+	__atomic_store_n(&rd->pending, false, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&rd->error, __ATOMIC_ACQUIRE)) {
+		vlist_delete(&phy_list, &phy->node);
+		return;
+	}
+
+	rcd_phy_ring_consume(phy);
+
+	if (__atomic_exchange_n(&rd->full, false, __ATOMIC_SEQ_CST))
+		reader_signal(rd->wake_fd);
+}
+
+/* parse a comma separated list of CPUs for the reader threads */
+int rcd_phy_reader_init(unsigned int threads, const char *cpus)
+{
+	const char *cur = cpus;
+	unsigned long cpu;
+	int *list;
+	char *end;
+
+	n_readers = threads;
+	if (!cpus || !*cpus)
+		return 0;
+
+	while (*cur) {
+		cpu = strtoul(cur, &end, 10);
+		if (end == cur || (*end && *end != ',') || cpu >= CPU_SETSIZE)
+			return -1;
+
+		list = realloc(reader_cpus, (n_reader_cpus + 1) * sizeof(*list));
+		if (!list)
+			return -1;
+
+		reader_cpus = list;
+		reader_cpus[n_reader_cpus++] = cpu;
+		cur = *end ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+/* returns false if the PHY is to be read from the uloop thread */
+bool rcd_phy_reader_start(struct phy *phy, int event_fd)
+{
+	struct phy_reader *rd;
+	sigset_t sigs, old;
+	cpu_set_t set;
+
+	if (phy->reader || n_started >= n_readers)
+		return false;
+
+	rd = calloc(1, sizeof(*rd));
+	if (!rd)
+		return false;
+
+	/* the thread must not block in read() to be able to stop */
+	fcntl(event_fd, F_SETFL, fcntl(event_fd, F_GETFL) | O_NONBLOCK);
+
+	rd->phy = phy;
+	rd->event_fd = event_fd;
+	rd->cpu = n_reader_cpus ? reader_cpus[n_started % n_reader_cpus] : -1;
+
+	rd->notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rd->notify.fd < 0)
+		goto free;
+
+	rd->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rd->wake_fd < 0)
+		goto close_notify;
+
+	/* signals are handled by the main thread */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_SETMASK, &sigs, &old);
+	if (pthread_create(&rd->thread, NULL, reader_thread, rd)) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		goto close_wake;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rd->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(rd->cpu, &set);
+		if (pthread_setaffinity_np(rd->thread, sizeof(set), &set))
+			fprintf(stderr, "WARNING: failed to pin the %s reader to CPU %d\n",
+				phy_name(phy), rd->cpu);
+	}
+
+	rd->notify.cb = reader_notify_cb;
+	uloop_fd_add(&rd->notify, ULOOP_READ);
+	phy->reader = rd;
+	n_started++;
+
+	return true;
+
+close_wake:
+	close(rd->wake_fd);
+close_notify:
+	close(rd->notify.fd);
+free:
+	free(rd);
+	return false;
+}
+
+void rcd_phy_reader_stop(struct phy *phy)
+{
+	struct phy_reader *rd = phy->reader;
+
+	if (!rd)
+		return;
+
+	__atomic_store_n(&rd->stop, true, __ATOMIC_RELEASE);
+	reader_signal(rd->wake_fd);
+	pthread_join(rd->thread, NULL);
+
+	uloop_fd_delete(&rd->notify);
+	close(rd->notify.fd);
+	close(rd->wake_fd);
+	free(rd);
+
+	phy->reader = NULL;
+	n_started--;
+}
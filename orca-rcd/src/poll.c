@@ -0,0 +1,475 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include "rcd.h"
+
+/*
+ * Periodic polling of debugfs files that can not be streamed. A file is
+ * polled once per interval for all clients that registered the same PHY,
+ * path and interval. The file stays open and is re-read into one of two
+ * buffers that are reused, so that each poll is compared line by line to
+ * the previous one. Only the lines that changed are sent, preceded by a
+ * header with the number of lines of the file and of lines that follow:
+ *
+ *   <phy>;<ts>;debugfs_poll;<path>;d;<lines>;<changed>
+ *   <phy>;<ts>;debugfs_line;<path>;<index>;<text>
+ *
+ * A delta without changes is not sent at all. Every keyframe_ms, and for a
+ * client that just registered, all lines are sent instead, marked 'k'.
+ * Numbers are in hex, ts is CLOCK_MONOTONIC in ns like the API timestamps.
+ */
+#define POLL_KEYFRAME_MS	10000
+#define POLL_BUF_INIT		1024
+
+struct poll_snap {
+	char *buf;
+	size_t size;
+	size_t len;
+	/* start offsets of the lines in buf, each terminated by '\n' */
+	unsigned int *lines;
+	unsigned int n_lines;
+	unsigned int lines_size;
+};
+
+struct debugfs_poll {
+	struct list_head list;
+	struct list_head users;
+	struct phy *phy;
+	char *path;
+	int fd;
+	unsigned int interval_ms;
+	unsigned int keyframe_ms;
+	uint64_t last_key;
+	struct uloop_timeout timeout;
+
+	struct poll_snap snap[2];
+	unsigned int cur;
+	bool valid;
+
+	char *out;
+	size_t out_size;
+	size_t out_len;
+};
+
+struct debugfs_poll_user {
+	struct list_head list;
+	struct client *cl;
+	bool key;
+};
+
+static LIST_HEAD(polls);
+
+static uint64_t
+poll_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+poll_free(struct debugfs_poll *p)
+{
+	struct debugfs_poll_user *u, *tmp;
+	unsigned int i;
+
+	list_for_each_entry_safe(u, tmp, &p->users, list) {
+		list_del(&u->list);
+		free(u);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(p->snap); i++) {
+		free(p->snap[i].buf);
+		free(p->snap[i].lines);
+	}
+
+	uloop_timeout_cancel(&p->timeout);
+	close(p->fd);
+	list_del(&p->list);
+	free(p->out);
+	free(p->path);
+	free(p);
+}
+
+/* read the whole file into snap, which keeps its buffers between polls */
+static int
+poll_read(struct debugfs_poll *p, struct poll_snap *snap)
+{
+	unsigned int *lines;
+	size_t start;
+	ssize_t len;
+	char *buf;
+
+	if (lseek(p->fd, 0, SEEK_SET) < 0)
+		return errno;
+
+	snap->len = 0;
+	while (1) {
+		/* room for a final '\n' */
+		if (snap->size - snap->len < 2) {
+			buf = realloc(snap->buf, snap->size ? 2 * snap->size : POLL_BUF_INIT);
+			if (!buf)
+				return ENOMEM;
+
+			snap->buf = buf;
+			snap->size = snap->size ? 2 * snap->size : POLL_BUF_INIT;
+		}
+
+		len = read(p->fd, snap->buf + snap->len, snap->size - snap->len - 1);
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0)
+			return errno;
+
+		if (!len)
+			break;
+
+		snap->len += len;
+	}
+
+	if (snap->len && snap->buf[snap->len - 1] != '\n')
+		snap->buf[snap->len++] = '\n';
+
+	snap->n_lines = 0;
+	for (start = 0; start < snap->len; start = (char *) memchr(snap->buf + start, '\n',
+				snap->len - start) - snap->buf + 1) {
+		if (snap->n_lines == snap->lines_size) {
+			lines = realloc(snap->lines, (snap->lines_size + 64) * sizeof(*lines));
+			if (!lines)
+				return ENOMEM;
+
+			snap->lines = lines;
+			snap->lines_size += 64;
+		}
+
+		snap->lines[snap->n_lines++] = start;
+	}
+
+	return 0;
+}
+
+static inline const char *
+poll_line(const struct poll_snap *snap, unsigned int i, size_t *len)
+{
+	const char *line = snap->buf + snap->lines[i];
+
+	*len = (const char *) memchr(line, '\n', snap->buf + snap->len - line) - line;
+	return line;
+}
+
+static bool
+poll_line_changed(const struct poll_snap *new, const struct poll_snap *old, unsigned int i)
+{
+	const char *a, *b;
+	size_t a_len, b_len;
+
+	if (i >= old->n_lines)
+		return true;
+
+	a = poll_line(new, i, &a_len);
+	b = poll_line(old, i, &b_len);
+
+	return a_len != b_len || memcmp(a, b, a_len);
+}
+
+static int
+poll_printf(struct debugfs_poll *p, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *out;
+	int len;
+
+	while (1) {
+		va_start(ap, fmt);
+		len = vsnprintf(p->out + p->out_len, p->out_size - p->out_len, fmt, ap);
+		va_end(ap);
+
+		if (len < 0)
+			return EINVAL;
+
+		if ((size_t) len < p->out_size - p->out_len)
+			break;
+
+		size = p->out_size ? 2 * p->out_size : POLL_BUF_INIT;
+		while (size - p->out_len <= (size_t) len)
+			size *= 2;
+
+		out = realloc(p->out, size);
+		if (!out)
+			return ENOMEM;
+
+		p->out = out;
+		p->out_size = size;
+	}
+
+	p->out_len += len;
+	return 0;
+}
+
+/* format a keyframe, or the lines that changed since old if old is set */
+static int
+poll_format(struct debugfs_poll *p, uint64_t ts, const struct poll_snap *new,
+	    const struct poll_snap *old)
+{
+	const char *name = phy_name(p->phy);
+	unsigned int i, changed = 0;
+	const char *line;
+	size_t len;
+	int err;
+
+	for (i = 0; i < new->n_lines; i++)
+		if (!old || poll_line_changed(new, old, i))
+			changed++;
+
+	p->out_len = 0;
+	if (old && !changed && new->n_lines == old->n_lines)
+		return 0;
+
+	err = poll_printf(p, "%s;%llx;debugfs_poll;%s;%c;%x;%x\n", name,
+			  (unsigned long long) ts, p->path, old ? 'd' : 'k',
+			  new->n_lines, changed);
+
+	for (i = 0; i < new->n_lines && !err; i++) {
+		if (old && !poll_line_changed(new, old, i))
+			continue;
+
+		line = poll_line(new, i, &len);
+		err = poll_printf(p, "%s;%llx;debugfs_line;%s;%x;%.*s\n", name,
+				  (unsigned long long) ts, p->path, i, (int) len, line);
+	}
+
+	return err;
+}
+
+/* send with a single write, so compressed clients get one frame */
+static void
+poll_send(struct debugfs_poll *p, bool key)
+{
+	struct debugfs_poll_user *u;
+
+	if (!p->out_len)
+		return;
+
+	list_for_each_entry(u, &p->users, list) {
+		if (u->key != key)
+			continue;
+
+		client_send(u->cl, p->out, p->out_len);
+		u->key = false;
+	}
+}
+
+static void
+poll_error(struct debugfs_poll *p, int err)
+{
+	struct debugfs_poll_user *u;
+
+	list_for_each_entry(u, &p->users, list)
+		client_phy_printf(u->cl, p->phy, "0;#error;debugfs_poll %s: %s\n", p->path,
+				  strerror(err));
+
+	poll_free(p);
+}
+
+static void
+poll_timeout(struct uloop_timeout *t)
+{
+	struct debugfs_poll *p = container_of(t, struct debugfs_poll, timeout);
+	struct poll_snap *new = &p->snap[!p->cur], *old = &p->snap[p->cur];
+	struct debugfs_poll_user *u;
+	uint64_t ts = poll_now_ns();
+	bool key;
+	int err;
+
+	uloop_timeout_set(t, p->interval_ms);
+
+	err = poll_read(p, new);
+	if (err) {
+		poll_error(p, err);
+		return;
+	}
+
+	key = !p->valid || ts - p->last_key >= p->keyframe_ms * 1000000ULL;
+	if (key) {
+		p->last_key = ts;
+		list_for_each_entry(u, &p->users, list)
+			u->key = true;
+	} else {
+		err = poll_format(p, ts, new, old);
+		if (err)
+			goto error;
+
+		poll_send(p, false);
+	}
+
+	/* users that just registered get a keyframe */
+	list_for_each_entry(u, &p->users, list) {
+		if (!u->key)
+			continue;
+
+		err = poll_format(p, ts, new, NULL);
+		if (err)
+			goto error;
+
+		poll_send(p, true);
+		break;
+	}
+
+	p->cur = !p->cur;
+	p->valid = true;
+	return;
+
+error:
+	poll_error(p, err);
+}
+
+static struct debugfs_poll *
+poll_find(struct phy *phy, const char *path, unsigned int interval_ms)
+{
+	struct debugfs_poll *p;
+
+	list_for_each_entry(p, &polls, list)
+		if (p->phy == phy && p->interval_ms == interval_ms && !strcmp(p->path, path))
+			return p;
+
+	return NULL;
+}
+
+static struct debugfs_poll *
+poll_create(struct phy *phy, int fd, const char *path, unsigned int interval_ms,
+	    unsigned int keyframe_ms)
+{
+	struct debugfs_poll *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	p->path = strdup(path);
+	if (!p->path) {
+		free(p);
+		return NULL;
+	}
+
+	p->phy = phy;
+	p->fd = fd;
+	p->interval_ms = interval_ms;
+	p->keyframe_ms = keyframe_ms;
+	p->timeout.cb = poll_timeout;
+	INIT_LIST_HEAD(&p->users);
+	list_add_tail(&p->list, &polls);
+
+	return p;
+}
+
+/* drop the client's registrations for the PHY and path, of any interval */
+static void
+poll_detach(struct client *cl, struct phy *phy, const char *path)
+{
+	struct debugfs_poll *p, *tmp;
+	struct debugfs_poll_user *u, *utmp;
+
+	list_for_each_entry_safe(p, tmp, &polls, list) {
+		if (p->phy != phy || strcmp(p->path, path) != 0)
+			continue;
+
+		list_for_each_entry_safe(u, utmp, &p->users, list) {
+			if (u->cl != cl)
+				continue;
+
+			list_del(&u->list);
+			free(u);
+		}
+
+		if (list_empty(&p->users))
+			poll_free(p);
+	}
+}
+
+/* <interval_ms>[;<keyframe_ms>], an interval of 0 stops polling */
+int rcd_debugfs_poll(struct client *cl, struct phy *phy, int fd, const char *path, char *args)
+{
+	unsigned long interval, keyframe = POLL_KEYFRAME_MS;
+	struct debugfs_poll_user *u;
+	struct debugfs_poll *p;
+	char *end;
+
+	if (!args || !*args)
+		goto inval;
+
+	interval = strtoul(args, &end, 10);
+	if (*end == ';')
+		keyframe = strtoul(end + 1, &end, 10);
+	if (*end || interval > UINT32_MAX || keyframe > UINT32_MAX)
+		goto inval;
+
+	poll_detach(cl, phy, path);
+	if (!interval) {
+		close(fd);
+		return 0;
+	}
+
+	p = poll_find(phy, path, interval);
+	if (p) {
+		close(fd);
+	} else {
+		p = poll_create(phy, fd, path, interval, keyframe);
+		if (!p) {
+			close(fd);
+			return ENOMEM;
+		}
+
+		uloop_timeout_set(&p->timeout, 0);
+	}
+
+	u = calloc(1, sizeof(*u));
+	if (!u) {
+		if (list_empty(&p->users))
+			poll_free(p);
+		return ENOMEM;
+	}
+
+	u->cl = cl;
+	u->key = true;
+	list_add_tail(&u->list, &p->users);
+
+	return 0;
+
+inval:
+	close(fd);
+	return EINVAL;
+}
+
+void rcd_debugfs_poll_client_free(struct client *cl)
+{
+	struct debugfs_poll *p, *tmp;
+	struct debugfs_poll_user *u, *utmp;
+
+	list_for_each_entry_safe(p, tmp, &polls, list) {
+		list_for_each_entry_safe(u, utmp, &p->users, list) {
+			if (u->cl != cl)
+				continue;
+
+			list_del(&u->list);
+			free(u);
+		}
+
+		if (list_empty(&p->users))
+			poll_free(p);
+	}
+}
+
+void rcd_debugfs_poll_phy_free(struct phy *phy)
+{
+	struct debugfs_poll *p, *tmp;
+
+	list_for_each_entry_safe(p, tmp, &polls, list)
+		if (p->phy == phy)
+			poll_free(p);
+}
@@ -0,0 +1,472 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <sys/uio.h>
+#include <errno.h>
+#include "rcd.h"
+
+/*
+ * Client output. Everything written to a client during one loop iteration is
+ * gathered in its batch, as references to the shared lines where possible,
+ * and written with a single writev() once the iteration is done, or after
+ * batch_ms at the latest. What the socket does not take goes to the ustream.
+ *
+ * Output is bounded: everything written to a client counts against its
+ * budget of max_bytes, which includes the batch and what the ustream still
+ * holds. Plain clients write directly until that is a quarter of the
+ * budget; beyond that, lines are queued per client and moved out as the
+ * ustream drains. When the budget is exceeded, the policy applies:
+ *
+ *   disconnect: the client is closed
+ *   drop:       the oldest queued txs/rxs/stats lines are dropped
+ *   conflate:   like drop, but a queued stats or txs_summary line is replaced
+ *               by a newer one of the same station first
+ *
+ * Control responses, state and sta/if lines are never dropped. Dropped lines
+ * are reported to the client by a "*;0;#gap;<count>" line where they were
+ * dropped. The output of compressed and binary clients can not be thinned
+ * out without breaking their decoder state, so they are always disconnected
+ * once they exceed the budget.
+ */
+enum client_policy {
+	CLIENT_POLICY_DISCONNECT,
+	CLIENT_POLICY_DROP,
+	CLIENT_POLICY_CONFLATE,
+};
+
+struct client_qent {
+	struct list_head list;
+	struct rcd_line *line;
+	enum client_line_kind kind;
+	struct client_conflate *cf;
+};
+
+/* the queued lines of a station that are subject to conflation */
+struct client_conflate {
+	struct mac_entry node;
+	const struct phy *phy;
+	struct client_qent *ent[CLIENT_LINE_CONFLATE_MAX];
+};
+
+/* a batch is written early once it is this large */
+#define CLIENT_BATCH_BYTES	(32 * 1024)
+
+static size_t max_bytes;
+static unsigned int max_lines;
+static enum client_policy policy;
+
+static LIST_HEAD(batch_clients);
+static unsigned int batch_ms;
+
+static void
+client_batch_timer(struct uloop_timeout *t)
+{
+	rcd_client_flush();
+}
+
+static struct uloop_timeout batch_timer = {
+	.cb = client_batch_timer,
+};
+
+int rcd_client_queue_init(const struct client_opts *o)
+{
+	if (!strcmp(o->policy, "disconnect"))
+		policy = CLIENT_POLICY_DISCONNECT;
+	else if (!strcmp(o->policy, "drop"))
+		policy = CLIENT_POLICY_DROP;
+	else if (!strcmp(o->policy, "conflate"))
+		policy = CLIENT_POLICY_CONFLATE;
+	else
+		return -1;
+
+	max_bytes = o->max_bytes;
+	max_lines = o->max_lines;
+	batch_ms = o->batch_ms;
+
+	return 0;
+}
+
+enum client_line_kind rcd_event_line_kind(const struct rcd_event *ev)
+{
+	switch (ev->type) {
+	case RCD_EV_TXS:
+	case RCD_EV_RXS:
+		return CLIENT_LINE_TELEMETRY;
+	case RCD_EV_STATS:
+		return ev->has_mac ? CLIENT_LINE_STATS : CLIENT_LINE_TELEMETRY;
+	default:
+		return CLIENT_LINE_PROTECTED;
+	}
+}
+
+static inline size_t
+client_pending(struct client *cl)
+{
+	return ustream_pending_data(&cl->sfd.stream, true) + cl->batch_bytes;
+}
+
+static void
+client_disconnect(struct client *cl)
+{
+	struct ustream *s = &cl->sfd.stream;
+
+	if (s->write_error)
+		return;
+
+	fprintf(stderr, "WARNING: disconnecting client with %zu bytes of pending output\n",
+		client_pending(cl) + cl->queue_bytes);
+
+	/* the client is freed from its state change callback */
+	s->write_error = true;
+	ustream_state_change(s);
+}
+
+static void
+client_batch_release(struct client *cl)
+{
+	unsigned int i;
+
+	for (i = 0; i < cl->batch_lines; i++)
+		rcd_line_put(cl->batch[i]);
+
+	cl->batch_lines = 0;
+	cl->batch_bytes = 0;
+	cl->batch_tail = NULL;
+	list_del_init(&cl->batch_list);
+}
+
+/* the ustream takes what the socket does not */
+static void
+client_batch_flush(struct client *cl)
+{
+	struct iovec iov[CLIENT_BATCH_LINES];
+	struct ustream *s = &cl->sfd.stream;
+	struct rcd_line *line;
+	ssize_t ret = 0;
+	unsigned int i;
+
+	if (s->write_error)
+		goto out;
+
+	cl->stats.bytes += cl->batch_bytes;
+	cl->stats.writes++;
+	rcd_hist_add(&rcd_stats.client_write, cl->batch_bytes);
+
+	if (!ustream_pending_data(s, true)) {
+		for (i = 0; i < cl->batch_lines; i++) {
+			iov[i].iov_base = cl->batch[i]->data;
+			iov[i].iov_len = cl->batch[i]->len;
+		}
+
+		do {
+			ret = writev(cl->sfd.fd.fd, iov, cl->batch_lines);
+		} while (ret < 0 && errno == EINTR);
+
+		/* errors are left to the ustream to run into */
+		if (ret < 0)
+			ret = 0;
+	}
+
+	for (i = 0; i < cl->batch_lines; i++) {
+		line = cl->batch[i];
+		if (ret >= line->len) {
+			ret -= line->len;
+			continue;
+		}
+
+		ustream_write(s, line->data + ret, line->len - ret, false);
+		ret = 0;
+	}
+
+out:
+	client_batch_release(cl);
+}
+
+/* takes over the reference to the line */
+static void
+client_batch_add(struct client *cl, struct rcd_line *line, bool private)
+{
+	if (list_empty(&cl->batch_list)) {
+		list_add_tail(&cl->batch_list, &batch_clients);
+		if (!batch_timer.pending)
+			uloop_timeout_set(&batch_timer, batch_ms);
+	}
+
+	cl->batch[cl->batch_lines++] = line;
+	cl->batch_bytes += line->len;
+	cl->batch_tail = private ? line : NULL;
+
+	if (cl->batch_lines == CLIENT_BATCH_LINES || cl->batch_bytes >= CLIENT_BATCH_BYTES)
+		client_batch_flush(cl);
+}
+
+/* data that is not a line of its own is copied, to the last line if it is private */
+static void
+client_batch_data(struct client *cl, const void *data, size_t len)
+{
+	struct rcd_line *line = cl->batch_tail;
+
+	if (line && line->size - line->len >= len) {
+		memcpy(line->data + line->len, data, len);
+		line->len += len;
+		cl->batch_bytes += len;
+		if (cl->batch_bytes >= CLIENT_BATCH_BYTES)
+			client_batch_flush(cl);
+		return;
+	}
+
+	line = rcd_line_alloc(len);
+	if (!line) {
+		client_disconnect(cl);
+		return;
+	}
+
+	memcpy(line->data, data, len);
+	line->len = len;
+	client_batch_add(cl, line, true);
+}
+
+void rcd_client_flush(void)
+{
+	struct client *cl, *tmp;
+
+	uloop_timeout_cancel(&batch_timer);
+	list_for_each_entry_safe(cl, tmp, &batch_clients, batch_list)
+		client_batch_flush(cl);
+}
+
+static void
+conflate_free(struct mac_entry *e)
+{
+	free(container_of(e, struct client_conflate, node));
+}
+
+static void
+qent_free(struct client *cl, struct client_qent *ent)
+{
+	if (ent->cf)
+		ent->cf->ent[ent->kind - CLIENT_LINE_STATS] = NULL;
+
+	list_del(&ent->list);
+	cl->queue_lines--;
+	cl->queue_bytes -= ent->line->len;
+	rcd_line_put(ent->line);
+	free(ent);
+}
+
+static void
+qent_drop(struct client *cl, struct client_qent *ent)
+{
+	qent_free(cl, ent);
+	cl->gap++;
+	cl->dropped++;
+}
+
+static inline bool
+client_over_budget(struct client *cl)
+{
+	if (max_lines && cl->queue_lines > max_lines)
+		return true;
+
+	return max_bytes && client_pending(cl) + cl->queue_bytes > max_bytes;
+}
+
+/* replace the queued line of the same station and kind, if there is one */
+static void
+client_conflate(struct client *cl, struct client_qent *ent, const struct phy *phy,
+		const uint8_t *addr)
+{
+	unsigned int slot = ent->kind - CLIENT_LINE_STATS;
+	struct client_conflate *cf;
+	struct mac_entry *e;
+
+	e = mac_table_get(&cl->conflate, addr);
+	if (e) {
+		cf = container_of(e, struct client_conflate, node);
+
+		/* the same station on another PHY is left alone */
+		if (cf->phy != phy)
+			return;
+	} else {
+		cf = calloc(1, sizeof(*cf));
+		if (!cf)
+			return;
+
+		memcpy(cf->node.addr, addr, sizeof(cf->node.addr));
+		cf->phy = phy;
+		if (mac_table_add(&cl->conflate, &cf->node)) {
+			free(cf);
+			return;
+		}
+	}
+
+	if (cf->ent[slot])
+		qent_drop(cl, cf->ent[slot]);
+
+	cf->ent[slot] = ent;
+	ent->cf = cf;
+}
+
+static void
+client_queue_trim(struct client *cl)
+{
+	struct client_qent *ent, *tmp;
+
+	if (policy == CLIENT_POLICY_DISCONNECT) {
+		client_disconnect(cl);
+		return;
+	}
+
+	list_for_each_entry_safe(ent, tmp, &cl->queue, list) {
+		if (!client_over_budget(cl))
+			return;
+
+		if (ent->kind != CLIENT_LINE_PROTECTED)
+			qent_drop(cl, ent);
+	}
+
+	/* only lines that must not be dropped are left, allow some slack for them */
+	if (max_bytes && client_pending(cl) + cl->queue_bytes > 2 * max_bytes)
+		client_disconnect(cl);
+}
+
+static void
+client_enqueue(struct client *cl, struct rcd_line *line, enum client_line_kind kind,
+	       const struct phy *phy, const uint8_t *addr)
+{
+	struct client_qent *ent;
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent) {
+		cl->gap++;
+		cl->dropped++;
+		return;
+	}
+
+	ent->line = rcd_line_get(line);
+	ent->kind = kind;
+	list_add_tail(&ent->list, &cl->queue);
+	cl->queue_lines++;
+	cl->queue_bytes += line->len;
+
+	if (policy == CLIENT_POLICY_CONFLATE && kind >= CLIENT_LINE_STATS && addr)
+		client_conflate(cl, ent, phy, addr);
+
+	if (client_over_budget(cl))
+		client_queue_trim(cl);
+}
+
+/* the ustream of a plain client takes up to a quarter of the budget */
+static inline bool
+client_direct(struct client *cl, size_t len)
+{
+	if (!list_empty(&cl->queue))
+		return false;
+
+	return !max_bytes || client_pending(cl) + len <= max_bytes / 4;
+}
+
+/* compressed and binary output can only be cut off as a whole */
+static inline void
+client_check_budget(struct client *cl)
+{
+	if (max_bytes && client_pending(cl) > max_bytes)
+		client_disconnect(cl);
+}
+
+void client_write_line(struct client *cl, struct rcd_line *line, enum client_line_kind kind,
+		       const struct phy *phy, const uint8_t *addr)
+{
+	if (cl->sfd.stream.write_error)
+		return;
+
+	if (cl->compression || cl->binary) {
+		client_batch_add(cl, rcd_line_get(line), false);
+		client_check_budget(cl);
+		return;
+	}
+
+	if (client_direct(cl, line->len)) {
+		client_batch_add(cl, rcd_line_get(line), false);
+		return;
+	}
+
+	client_enqueue(cl, line, kind, phy, addr);
+}
+
+void client_write(struct client *cl, const void *data, size_t len)
+{
+	struct rcd_line *line;
+
+	if (cl->sfd.stream.write_error)
+		return;
+
+	if (cl->compression || cl->binary) {
+		client_batch_data(cl, data, len);
+		client_check_budget(cl);
+		return;
+	}
+
+	if (client_direct(cl, len)) {
+		client_batch_data(cl, data, len);
+		return;
+	}
+
+	/* keep the order with the lines already queued */
+	line = rcd_line_alloc(len);
+	if (!line) {
+		client_disconnect(cl);
+		return;
+	}
+
+	memcpy(line->data, data, len);
+	line->len = len;
+	client_enqueue(cl, line, CLIENT_LINE_PROTECTED, NULL, NULL);
+	rcd_line_put(line);
+}
+
+static void
+client_gap_marker(struct client *cl)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "*;0;#gap;%llx\n", (unsigned long long) cl->gap);
+	client_batch_data(cl, buf, len);
+	cl->gap = 0;
+}
+
+/* move queued lines out as the ustream drains */
+void client_queue_drain(struct client *cl)
+{
+	struct client_qent *ent;
+
+	while (!list_empty(&cl->queue) && client_pending(cl) < max_bytes / 4) {
+		if (cl->gap)
+			client_gap_marker(cl);
+
+		ent = list_first_entry(&cl->queue, struct client_qent, list);
+		client_batch_add(cl, rcd_line_get(ent->line), false);
+		qent_free(cl, ent);
+	}
+
+	if (!list_empty(&cl->queue))
+		return;
+
+	/* the lines after the last ones dropped went out directly */
+	if (cl->gap)
+		client_gap_marker(cl);
+
+	mac_table_flush(&cl->conflate, conflate_free);
+}
+
+void client_queue_free(struct client *cl)
+{
+	struct client_qent *ent, *tmp;
+
+	list_for_each_entry_safe(ent, tmp, &cl->queue, list)
+		qent_free(cl, ent);
+
+	client_batch_release(cl);
+	mac_table_flush(&cl->conflate, conflate_free);
+}
@@ -32,18 +32,269 @@ extern const char *global_id;
 extern const char *global_topic;
 #endif
 
+/*
+ * api_event ring buffer. head, tail and scan are free-running byte counters:
+ * data between tail and head has been read but not consumed yet, and scan
+ * marks how far it has already been searched for newlines.
+ */
+struct phy_ring {
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	size_t scan;
+};
+
+/* hash table keyed by MAC address, see mac.c */
+struct mac_entry {
+	struct mac_entry *next;
+	uint8_t addr[6];
+};
+
+struct mac_table {
+	struct mac_entry **buckets;
+	unsigned int mask;
+	unsigned int count;
+};
+
+#define mac_table_for_each(t, e, i) \
+	for (i = 0; (t)->buckets && i <= (t)->mask; i++) \
+		for (e = (t)->buckets[i]; e; e = e->next)
+
+#define mac_table_for_each_safe(t, e, n, i) \
+	for (i = 0; (t)->buckets && i <= (t)->mask; i++) \
+		for (e = (t)->buckets[i]; e && ((n = e->next), 1); e = n)
+
+#define MAC_FMT "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC_ARG(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+
+/*
+ * Sampling of txs/rxs events per station: either a deterministic 1-in-n
+ * selection by a hash of station and event timestamp, or the first event of
+ * a station in each interval_ms window.
+ */
+struct rcd_sampler {
+	unsigned int n;
+	unsigned int interval_ms;
+	struct mac_table stations;
+};
+
+/*
+ * Receiver of the periodic txs summaries of a PHY, see aggr.c. cb is called
+ * with each summary line, or with NULL when the PHY is removed.
+ */
+struct rcd_line;
+
+struct txs_aggr_user {
+	struct list_head list;
+	struct txs_aggr *aggr;
+	void (*cb)(struct txs_aggr_user *u, struct rcd_line *line);
+};
+
+/* cached initial state output of a PHY, as plain text and as one zstd frame */
+struct phy_snapshot {
+	struct rcd_line *plain;
+	struct rcd_line *zstd;
+};
+
 struct phy {
 	struct vlist_node node;
 
 	struct uloop_fd event_fd;
-	int control_fd;
+	struct uloop_fd control_fd;
+	/* commands waiting for api_control to become writable, see control.c */
+	struct list_head control_queue;
+	unsigned int control_queued;
+	struct {
+		uint64_t written;
+		uint64_t skipped;
+		uint64_t coalesced;
+	} control_stats;
+
+	/* api_event reader thread in threaded mode, see phy_thread.c */
+	struct phy_reader *reader;
+	struct phy_ring ring;
+	struct phy_snapshot info;
+	struct phy_snapshot state;
+
+	/* current stations, keyed by MAC, see struct phy_sta */
+	struct mac_table stations;
+	bool stations_stale;
+
+	/* sampling of the PHY's events for all clients and MQTT */
+	struct rcd_sampler sampler;
+
+	/* small number identifying the PHY on binary connections, never reused */
+	unsigned int id;
+
+	/* txs aggregators, one per summary interval in use */
+	struct list_head txs_aggrs;
+#ifdef CONFIG_MQTT
+	struct txs_aggr_user mqtt_aggr;
+#endif
+
+	struct {
+		uint64_t wakeups;
+		uint64_t reads;
+		uint64_t lines;
+		uint64_t bytes;
+		uint64_t overflows;
+		/* events handed to the clients, after sampling */
+		uint64_t forwarded;
+	} stats;
+};
+
+struct phy_opts {
+	size_t event_bufsize;
+	const char *backend;
+	const char *debugfs_root;
+	const char *sysfs_root;
+	const char *discovery;
+	const char *event_sample;
+	unsigned int txs_summary_mqtt;
+	unsigned int ingest_threads;
+	const char *ingest_cpus;
+	unsigned int control_queue;
+	bool control_coalesce;
+	unsigned int synth_phys;
+	unsigned int synth_stations;
+	unsigned int synth_rate;
+};
+
+#define PHY_OPTS_DEFAULTS {\
+	.event_bufsize = 16384,\
+	.backend = "debugfs",\
+	.debugfs_root = "/sys/kernel/debug/ieee80211",\
+	.sysfs_root = "/sys/class/ieee80211",\
+	.discovery = "auto",\
+	.control_queue = 64,\
+	.synth_phys = 1,\
+	.synth_stations = 8,\
+	.synth_rate = 1000,\
+}
+
+/*
+ * Source of PHYs and their ORCA API files. init() starts PHY discovery and
+ * reports PHYs through rcd_phy_add(). open() opens one of the API files in
+ * the PHY's rc directory, debugfs_open() a file relative to the PHY's
+ * debugfs directory.
+ */
+struct phy_backend {
+	const char *name;
+	int (*init)(const struct phy_opts *o);
+	int (*open)(struct phy *phy, const char *file, int flags);
+	int (*debugfs_open)(struct phy *phy, const char *file, int flags);
 };
 
+extern const struct phy_backend phy_debugfs_backend;
+extern const struct phy_backend phy_synth_backend;
+
+/*
+ * Refcounted, preformatted output line. A line is formatted once and then
+ * handed to every consumer, each of which takes its own reference.
+ */
+struct rcd_line {
+	struct rcd_line *next;
+	unsigned int refcount;
+	unsigned int len;
+	unsigned int size;
+	char data[];
+};
+
+/* api_event line types that clients can filter on */
+enum rcd_event_type {
+	RCD_EV_TXS,
+	RCD_EV_RXS,
+	RCD_EV_STATS,
+	RCD_EV_STA,
+	RCD_EV_IF,
+	RCD_EV_OTHER,
+	__RCD_EV_MAX
+};
+
+/*
+ * An api_event line of a PHY ("<ts>;<type>;..."), parsed once before it is
+ * handed to the clients. addr is the station the event refers to, if any.
+ */
+struct rcd_event {
+	struct phy *phy;
+	const char *str;
+	size_t len;
+	enum rcd_event_type type;
+	bool has_mac;
+	uint8_t addr[6];
+	/* number of events this one stands for after sampling, see sample.c */
+	unsigned int scale;
+};
+
+/* a command with an optional client supplied ID, see control.c */
+#define RCD_REQUEST_ID_MAX	32
+
+struct rcd_request {
+	char id[RCD_REQUEST_ID_MAX + 1];
+	uint64_t start;
+};
+
+/* lines a client gathers before they are written early, see queue.c */
+#define CLIENT_BATCH_LINES	64
+
 struct client {
 	struct list_head list;
 	struct ustream_fd sfd;
 	bool init_done;
 	bool compression;
+
+	/* event subscriptions, see filter.c. Empty means all events */
+	struct list_head subs;
+	/* own compression buffer of a compressed client with subscriptions */
+	struct zstd_buf *zbuf;
+	/* compressed client that joins the shared stream at its next frame */
+	bool zstd_wait;
+
+	/* output gathered during a loop iteration, see queue.c */
+	struct list_head batch_list;
+	struct rcd_line *batch[CLIENT_BATCH_LINES];
+	unsigned int batch_lines;
+	size_t batch_bytes;
+	/* last line of the batch if it is private and can take more data */
+	struct rcd_line *batch_tail;
+
+	/* output beyond what the ustream takes, see queue.c */
+	struct list_head queue;
+	unsigned int queue_lines;
+	size_t queue_bytes;
+	struct mac_table conflate;
+	/* lines dropped since the last gap marker and in total */
+	uint64_t gap;
+	uint64_t dropped;
+	/* txs summary opt-ins, replacing the raw txs events of their PHY */
+	struct list_head aggrs;
+
+	struct {
+		uint64_t bytes;
+		uint64_t writes;
+	} stats;
+
+	/* binary protocol client, see binary.c: last timestamp sent per PHY id */
+	bool binary;
+	uint64_t *bin_ts;
+	unsigned int bin_ts_len;
+};
+
+#define RCD_BIN_BODY_MAX	192
+#define RCD_BIN_ANNOUNCE_MAX	32
+
+/* an event packed once for all binary clients */
+struct rcd_bin_event {
+	uint8_t type;
+	unsigned int phy_id;
+	uint64_t ts;
+	unsigned int scale;
+	size_t body_len;
+	uint8_t body[RCD_BIN_BODY_MAX];
+	/* announcement of the event's station if it was interned just now */
+	size_t announce_len;
+	uint8_t announce[RCD_BIN_ANNOUNCE_MAX];
 };
 
 struct server {
@@ -52,19 +303,29 @@ struct server {
 #ifdef CONFIG_ZSTD
 	struct uloop_fd zfd;
 #endif
+	struct uloop_fd bfd;
 	const char *addr;
 };
 
 #ifdef CONFIG_ZSTD
 struct zstd_buf;
-typedef void (*zstd_buf_flush_cb)(struct zstd_buf *buf, const void *data, size_t len);
+struct zstd_block;
+struct zstd_stream;
+/* end is set if the data completes a zstd frame */
+typedef void (*zstd_buf_flush_cb)(struct zstd_buf *buf, const void *data, size_t len,
+				  bool end);
 
 struct zstd_buf {
+	/* the block that currently collects input */
 	struct {
 		void *buf;
 		size_t size;
 		size_t pos;
-	} in, out;
+	} in;
+	struct zstd_block *blocks[2];
+	unsigned int cur;
+	/* set in streaming mode, see zstd.c */
+	struct zstd_stream *stream;
 	struct uloop_timeout timeout;
 	unsigned int timeout_ms;
 	zstd_buf_flush_cb flush;
@@ -87,6 +348,54 @@ struct mqtt_context {
 #endif
 
 
+/* log2 histogram: bucket i counts the values below 2^i, the last one the rest */
+#define RCD_HIST_BUCKETS	24
+
+struct rcd_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[RCD_HIST_BUCKETS];
+};
+
+enum rcd_zstd_flush {
+	RCD_ZSTD_FLUSH_FULL,
+	RCD_ZSTD_FLUSH_TIMEOUT,
+	RCD_ZSTD_FLUSH_EXPLICIT,
+	__RCD_ZSTD_FLUSH_MAX
+};
+
+/* daemon wide counters, only updated by the main loop, see stats.c */
+struct rcd_stats {
+	uint64_t commands;
+	uint64_t command_errors;
+	struct rcd_hist command_latency;
+	struct rcd_hist client_write;
+	uint64_t zstd_in;
+	uint64_t zstd_out;
+	uint64_t zstd_flush[__RCD_ZSTD_FLUSH_MAX];
+	uint64_t monitor_lines;
+	uint64_t monitor_bytes;
+	uint64_t mqtt_published;
+	uint64_t mqtt_errors;
+};
+
+extern struct rcd_stats rcd_stats;
+
+static inline void rcd_hist_add(struct rcd_hist *h, uint64_t val)
+{
+	unsigned int i = val ? 64 - __builtin_clzll(val) : 0;
+
+	if (i >= RCD_HIST_BUCKETS)
+		i = RCD_HIST_BUCKETS - 1;
+
+	h->count++;
+	h->sum += val;
+	h->buckets[i]++;
+}
+
+int rcd_stats_init(const char *listen);
+int rcd_stats_cmd(struct client *cl, struct phy *phy, char *args);
+
 static inline const char *phy_name(struct phy *phy)
 {
 	return phy->node.avl.key;
@@ -98,26 +407,145 @@ void rcd_server_add(const char *addr);
 void rcd_server_init(void);
 
 void rcd_client_accept(int fd, bool compression);
+void rcd_client_accept_binary(int fd);
 void rcd_client_broadcast(const char *fmt, ...);
-void rcd_client_phy_event(struct phy *phy, const char *str);
+void rcd_client_phy_event(const struct rcd_event *ev);
 void rcd_client_set_phy_state(struct client *cl, struct phy *phy, bool add);
 
 void rcd_api_info_dump(struct client *cl, struct phy *phy);
 
-void rcd_phy_init(void);
+struct rcd_line *rcd_line_alloc(size_t len);
+#define RCD_FIELDS_ALL		(~0ULL)
+#define RCD_SCALE_MARKER_LEN	13
+
+struct rcd_line *rcd_line_event(const struct rcd_event *ev, uint64_t fields, unsigned int scale);
+struct rcd_line *rcd_event_line(const struct rcd_event *ev, struct rcd_line **line);
+void rcd_line_put(struct rcd_line *line);
+
+static inline struct rcd_line *rcd_line_get(struct rcd_line *line)
+{
+	line->refcount++;
+	return line;
+}
+
+bool mac_parse(const char *str, uint8_t *addr);
+struct mac_entry *mac_table_get(struct mac_table *t, const uint8_t *addr);
+int mac_table_add(struct mac_table *t, struct mac_entry *e);
+void mac_table_del(struct mac_table *t, struct mac_entry *e);
+void mac_table_flush(struct mac_table *t, void (*free_cb)(struct mac_entry *e));
+
+void config_init_phy(struct phy_opts *o);
+
+int rcd_phy_init(const struct phy_opts *o);
+bool rcd_phy_add(const char *name);
+void rcd_phy_update_start(void);
+void rcd_phy_update_done(void);
 void rcd_phy_init_client(struct client *cl);
 void rcd_phy_info(struct client *cl, struct phy *phy);
 void rcd_phy_control(struct client *cl, char *data);
+void rcd_phy_control_init(unsigned int max, bool coalesce_rc);
+char *rcd_request_parse(struct rcd_request *req, char *data);
+void rcd_request_reply(struct client *cl, struct phy *phy, const struct rcd_request *req,
+		       const char *err);
+void rcd_phy_control_result(struct client *cl, struct phy *phy, const struct rcd_request *req,
+			    int error);
+int rcd_phy_control_write(struct client *cl, struct phy *phy, const struct rcd_request *req,
+			  const char *data);
+void rcd_phy_control_free(struct phy *phy);
+void rcd_phy_control_client_free(struct client *cl);
+int rcd_debugfs_poll(struct client *cl, struct phy *phy, int fd, const char *path, char *args);
+void rcd_debugfs_poll_client_free(struct client *cl);
+void rcd_debugfs_poll_phy_free(struct phy *phy);
+bool rcd_phy_cmd_addr(const char *cmd, uint8_t *addr);
+bool rcd_phy_rc_cmd(const char *cmd, uint8_t *addr);
+bool rcd_phy_rc_applied(struct phy *phy, const uint8_t *addr, const char *cmd);
+void rcd_phy_rc_update(struct phy *phy, const char *cmd, int error);
+int rcd_event_type_find(const char *name, size_t len);
+void rcd_phy_ring_consume(struct phy *phy);
+
+int rcd_phy_reader_init(unsigned int threads, const char *cpus);
+bool rcd_phy_reader_start(struct phy *phy, int event_fd);
+void rcd_phy_reader_stop(struct phy *phy);
 
 #define client_raw_printf(cl, ...) ustream_printf(&(cl)->sfd.stream, __VA_ARGS__)
 #define client_phy_printf(cl, phy, fmt, ...) client_printf(cl, "%s;" fmt, phy_name(phy), ## __VA_ARGS__)
-#define client_write(cl, buf, len) ustream_write(&(cl)->sfd.stream, buf, len, false)
+
+/* how queued output lines of a plain client may be dropped, see queue.c */
+enum client_line_kind {
+	CLIENT_LINE_PROTECTED,
+	CLIENT_LINE_TELEMETRY,
+	/* conflated per station */
+	CLIENT_LINE_STATS,
+	CLIENT_LINE_SUMMARY,
+};
+#define CLIENT_LINE_CONFLATE_MAX	2
+
+struct client_opts {
+	size_t max_bytes;
+	unsigned int max_lines;
+	const char *policy;
+	unsigned int batch_ms;
+	const char *metrics;
+};
+
+#define CLIENT_OPTS_DEFAULTS {\
+	.max_bytes = 4 * 1024 * 1024,\
+	.policy = "drop",\
+}
+
+void config_init_client(struct client_opts *o);
+int rcd_client_queue_init(const struct client_opts *o);
+enum client_line_kind rcd_event_line_kind(const struct rcd_event *ev);
+void client_write(struct client *cl, const void *data, size_t len);
+void client_write_line(struct client *cl, struct rcd_line *line, enum client_line_kind kind,
+		       const struct phy *phy, const uint8_t *addr);
+void client_queue_drain(struct client *cl);
+void client_queue_free(struct client *cl);
+void rcd_client_flush(void);
 
 int client_vprintf_compressed(struct client *cl, const char *fmt, va_list va_args);
 int client_vprintf(struct client *cl, const char *fmt, va_list va_args);
 int client_printf(struct client *cl, const char *fmt, ...);
+int client_send(struct client *cl, const void *data, size_t len);
+
+int rcd_client_subscribe(struct client *cl, struct phy *phy, char *args);
+int rcd_client_unsubscribe(struct client *cl, struct phy *phy, char *args);
+int rcd_client_project(struct client *cl, struct phy *phy, char *args);
+int rcd_client_sample(struct client *cl, struct phy *phy, char *args);
+bool rcd_client_event_filter(struct client *cl, const struct rcd_event *ev,
+			     struct rcd_line **out);
+struct rcd_line *rcd_client_event_line(struct client *cl, const struct rcd_event *ev,
+				       struct rcd_line **line);
+void rcd_projection_done(void);
+
+int rcd_sampler_parse(struct rcd_sampler *s, const char *spec);
+unsigned int rcd_sample(struct rcd_sampler *s, const struct rcd_event *ev);
+void rcd_sampler_free(struct rcd_sampler *s);
+
+static inline bool rcd_sampler_enabled(const struct rcd_sampler *s)
+{
+	return s->n > 1 || s->interval_ms;
+}
+void rcd_client_filter_free(struct client *cl);
+int rcd_client_txs_summary(struct client *cl, struct phy *phy, char *args);
+
+void rcd_bin_event_encode(const struct rcd_event *ev, struct rcd_bin_event *bev);
+void rcd_bin_event_send(struct client *cl, const struct rcd_bin_event *bev);
+int rcd_bin_text(struct client *cl, const char *data, size_t len);
+int rcd_bin_vprintf(struct client *cl, const char *fmt, va_list va_args);
+void rcd_bin_phy_announce(struct client *cl, struct phy *phy);
+void rcd_bin_client_start(struct client *cl);
+void rcd_bin_reset(void);
+int rcd_bin_handle_data(struct client *cl, const uint8_t *data, int len);
+
+int txs_aggr_attach(struct phy *phy, struct txs_aggr_user *u, unsigned int interval_ms);
+void txs_aggr_detach(struct txs_aggr_user *u);
+void txs_aggr_event(struct phy *phy, const struct rcd_event *ev);
+void txs_aggr_phy_free(struct phy *phy);
+struct phy *txs_aggr_phy(struct txs_aggr_user *u);
 
 bool rcd_has_clients(bool compression);
+void rcd_client_for_each(void (*cb)(struct client *cl, void *arg), void *arg);
 
 void rcd_config_init(void);
 
@@ -141,6 +569,7 @@ struct zstd_opts {
 	int comp_level;
 	size_t bufsize;
 	int timeout_ms;
+	unsigned int resync_ms;
 };
 
 #define ZSTD_OPTS_DEFAULTS {\
@@ -161,8 +590,16 @@ int zstd_fmt_compress(void **compressed, size_t *clen, const char *fmt, ...);
 int zstd_fmt_compress_va(void **buf, size_t *buflen, const char *fmt, va_list va_args);
 void zstd_stop(bool flush);
 int zstd_read_fmt(struct zstd_buf *buf, const char *fmt, ...);
-
-int rcd_debugfs_monitoring_start(const char *path, int port, size_t bufsize, unsigned int timeout,
+int zstd_buf_write(struct zstd_buf *buf, const void *data, size_t len);
+void zstd_buf_flush(struct zstd_buf *buf);
+int zstd_buf_init_default(struct zstd_buf *buf, zstd_buf_flush_cb cb);
+void zstd_buf_free(struct zstd_buf *buf);
+bool zstd_buf_at_frame_start(struct zstd_buf *buf);
+bool zstd_streaming(void);
+void rcd_client_zstd_resync(void);
+void client_zstd_private(struct client *cl);
+
+int rcd_debugfs_monitoring_start(int fd, int port, size_t bufsize, unsigned int timeout,
                                  bool compression);
 void rcd_debugfs_monitoring_stop(void);
 #else
@@ -185,14 +622,22 @@ static inline int zstd_fmt_compress(void **compressed, size_t *clen, const char
 static inline void zstd_read_fmt(void *buf, const char *fmt, ...)
 {
 }
+static inline int zstd_buf_write(void *buf, const void *data, size_t len)
+{
+	return -1;
+}
+static inline void client_zstd_private(struct client *cl)
+{
+}
 static inline int zstd_fmt_compress_va(void **buf, size_t *buflen, const char *fmt, va_list va_args)
 {
 	zstd_not_supported();
 	return -1;
 }
-static inline int rcd_debugfs_monitoring_start(const char *path, int port, size_t bufsize,
+static inline int rcd_debugfs_monitoring_start(int fd, int port, size_t bufsize,
                                                unsigned int timeout, bool compression)
 {
+	close(fd);
 	zstd_not_supported();
 	return -1;	
 }
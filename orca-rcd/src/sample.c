@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <errno.h>
+#include "rcd.h"
+
+/*
+ * Per-station sampling of txs and rxs events. Other events are always
+ * passed, as are events without a station address.
+ *
+ * 1-in-n sampling keeps an event if a hash of its station and timestamp
+ * falls into the lowest 1/n of the hash range. The decision only depends on
+ * the event itself, so every consumer sampling with the same n sees the
+ * same events, and the events kept with 1-in-100 are a subset of the ones
+ * kept with 1-in-10. Kept events are marked with scale n.
+ *
+ * Time based sampling keeps the first event of each station (and of each
+ * of txs/rxs) in every window of interval_ms, going by the event
+ * timestamps. It is marked with the number of events since the previous
+ * kept one, including itself, so consumers can rescale counts exactly.
+ */
+struct sample_sta {
+	struct mac_entry node;
+	uint64_t window[2];
+	unsigned int count[2];
+};
+
+static void
+sample_sta_free(struct mac_entry *e)
+{
+	free(container_of(e, struct sample_sta, node));
+}
+
+/* spec is "<n>" for 1-in-n or "<interval>ms", "0"/"1" or empty disables */
+int rcd_sampler_parse(struct rcd_sampler *s, const char *spec)
+{
+	unsigned long val;
+	char *end;
+
+	memset(s, 0, sizeof(*s));
+
+	if (!spec || !*spec)
+		return 0;
+
+	val = strtoul(spec, &end, 10);
+	if (end == spec || val > UINT32_MAX)
+		return EINVAL;
+
+	if (!strcmp(end, "ms"))
+		s->interval_ms = val;
+	else if (!*end)
+		s->n = val;
+	else
+		return EINVAL;
+
+	return 0;
+}
+
+void rcd_sampler_free(struct rcd_sampler *s)
+{
+	mac_table_flush(&s->stations, sample_sta_free);
+}
+
+static inline uint64_t
+sample_hash(const uint8_t *addr, uint64_t ts)
+{
+	uint64_t h = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		h = (h << 8) | addr[i];
+
+	/* splitmix64 finalizer, so every input bit affects the result */
+	h ^= ts * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return h;
+}
+
+static unsigned int
+sample_window(struct rcd_sampler *s, const struct rcd_event *ev, uint64_t ts)
+{
+	unsigned int idx = ev->type == RCD_EV_RXS, scale;
+	struct sample_sta *sta;
+	struct mac_entry *e;
+	uint64_t window = ts / (s->interval_ms * 1000000ULL);
+
+	e = mac_table_get(&s->stations, ev->addr);
+	if (e) {
+		sta = container_of(e, struct sample_sta, node);
+	} else {
+		sta = calloc(1, sizeof(*sta));
+		if (!sta)
+			return 1;
+
+		memcpy(sta->node.addr, ev->addr, sizeof(sta->node.addr));
+		sta->window[0] = sta->window[1] = UINT64_MAX;
+		if (mac_table_add(&s->stations, &sta->node)) {
+			free(sta);
+			return 1;
+		}
+	}
+
+	sta->count[idx]++;
+	if (sta->window[idx] == window)
+		return 0;
+
+	scale = sta->count[idx];
+	sta->window[idx] = window;
+	sta->count[idx] = 0;
+
+	return scale;
+}
+
+/* returns 0 if the event is dropped, otherwise the number of events it stands for */
+unsigned int rcd_sample(struct rcd_sampler *s, const struct rcd_event *ev)
+{
+	uint64_t ts;
+
+	if ((ev->type != RCD_EV_TXS && ev->type != RCD_EV_RXS) || !ev->has_mac)
+		return 1;
+
+	ts = strtoull(ev->str, NULL, 16);
+
+	if (s->interval_ms)
+		return sample_window(s, ev, ts);
+
+	if (s->n <= 1)
+		return 1;
+
+	if ((sample_hash(ev->addr, ts) >> 32) >= (1ULL << 32) / s->n)
+		return 0;
+
+	return s->n;
+}
@@ -81,6 +81,37 @@ zstd_server_cb(struct uloop_fd *fd, unsigned int events)
 }
 #endif
 
+static void
+binary_server_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct server *s = container_of(fd, struct server, bfd);
+	struct sockaddr_in6 addr;
+	unsigned int sl;
+	int cfd;
+
+	while (1) {
+		sl = sizeof(addr);
+		cfd = accept(fd->fd, (struct sockaddr *)&addr, &sl);
+
+		if (cfd < 0) {
+			if (errno == EAGAIN)
+				return;
+
+			if (errno == EINTR)
+				continue;
+
+			/* other error, restart */
+			uloop_fd_delete(fd);
+			close(fd->fd);
+			list_move_tail(&s->list, &pending);
+			uloop_timeout_set(&restart_timer, 1000);
+			return;
+		}
+
+		rcd_client_accept_binary(cfd);
+	}
+}
+
 static int
 server_fd_init(struct uloop_fd *fd, const char *addr, int port, uloop_fd_handler cb)
 {
@@ -105,6 +136,7 @@ static void server_start(struct server *s)
 #ifdef CONFIG_ZSTD
 	err += server_fd_init(&s->zfd, s->addr, RCD_PORT + 1, zstd_server_cb);
 #endif
+	err += server_fd_init(&s->bfd, s->addr, RCD_PORT + 2, binary_server_cb);
 	if (err)
 		return;
 
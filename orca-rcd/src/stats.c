@@ -0,0 +1,448 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Copyright (C) 2021-2024 SupraCoNeX Team <supraconex@gmail.com> */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <libubox/usock.h>
+#include <stddef.h>
+#include <errno.h>
+#include "rcd.h"
+
+/*
+ * Daemon metrics. The counters are plain integers updated by the main loop
+ * where the work is done anyway, apart from the api_event reader counters
+ * of a PHY, which reader threads update atomically. Nothing is computed
+ * until the metrics are asked for, either with the "*;stats" command or
+ * from the optional Prometheus listener, which get the same metrics:
+ *
+ *   *;0;stat;<name>[{<labels>}];<value>
+ *   orca_rcd_<name>[{<labels>}] <value>
+ */
+struct rcd_stats rcd_stats;
+
+struct stats_out {
+	FILE *f;
+	bool prom;
+};
+
+/* a request larger than this is not a scrape */
+#define METRICS_REQUEST_MAX	4096
+
+struct metrics_conn {
+	struct ustream_fd sfd;
+	bool done;
+};
+
+static struct uloop_fd metrics_fd;
+
+static void
+stats_family(struct stats_out *o, const char *name, const char *type, const char *help)
+{
+	if (o->prom)
+		fprintf(o->f, "# HELP orca_rcd_%s %s\n# TYPE orca_rcd_%s %s\n",
+			name, help, name, type);
+}
+
+static void
+stats_name(struct stats_out *o, const char *name, const char *suffix, const char *labels)
+{
+	fprintf(o->f, o->prom ? "orca_rcd_%s%s" : "*;0;stat;%s%s", name, suffix);
+	if (labels && *labels)
+		fprintf(o->f, "{%s}", labels);
+	fputc(o->prom ? ' ' : ';', o->f);
+}
+
+static void
+stats_value(struct stats_out *o, const char *name, const char *labels, uint64_t val)
+{
+	stats_name(o, name, "", labels);
+	fprintf(o->f, "%llu\n", (unsigned long long) val);
+}
+
+static void
+stats_counter(struct stats_out *o, const char *name, const char *help, uint64_t val)
+{
+	stats_family(o, name, "counter", help);
+	stats_value(o, name, NULL, val);
+}
+
+/* bucket i holds values below 2^i, so its upper bound is 2^i - 1 */
+static void
+stats_hist(struct stats_out *o, const char *name, const char *help, const struct rcd_hist *h)
+{
+	uint64_t sum = 0;
+	char le[32];
+	unsigned int i;
+
+	stats_family(o, name, "histogram", help);
+	for (i = 0; i < RCD_HIST_BUCKETS - 1; i++) {
+		sum += h->buckets[i];
+		snprintf(le, sizeof(le), "le=\"%llu\"", (1ULL << i) - 1);
+		stats_name(o, name, "_bucket", le);
+		fprintf(o->f, "%llu\n", (unsigned long long) sum);
+	}
+
+	stats_name(o, name, "_bucket", "le=\"+Inf\"");
+	fprintf(o->f, "%llu\n", (unsigned long long) h->count);
+	stats_name(o, name, "_sum", NULL);
+	fprintf(o->f, "%llu\n", (unsigned long long) h->sum);
+	stats_name(o, name, "_count", NULL);
+	fprintf(o->f, "%llu\n", (unsigned long long) h->count);
+}
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t offset;
+} phy_metrics[] = {
+	{ "phy_wakeups_total", "counter", "api_event wakeups",
+	  offsetof(struct phy, stats.wakeups) },
+	{ "phy_reads_total", "counter", "api_event reads",
+	  offsetof(struct phy, stats.reads) },
+	{ "phy_read_bytes_total", "counter", "Bytes read from api_event",
+	  offsetof(struct phy, stats.bytes) },
+	{ "phy_lines_total", "counter", "Lines read from api_event",
+	  offsetof(struct phy, stats.lines) },
+	{ "phy_overflows_total", "counter", "Lines dropped because they did not fit the event buffer",
+	  offsetof(struct phy, stats.overflows) },
+	{ "phy_forwarded_total", "counter", "Events forwarded to clients after sampling",
+	  offsetof(struct phy, stats.forwarded) },
+	{ "phy_control_written_total", "counter", "Commands written to api_control",
+	  offsetof(struct phy, control_stats.written) },
+	{ "phy_control_skipped_total", "counter", "Rate/power commands skipped as unchanged",
+	  offsetof(struct phy, control_stats.skipped) },
+	{ "phy_control_coalesced_total", "counter", "Queued rate/power commands superseded",
+	  offsetof(struct phy, control_stats.coalesced) },
+};
+
+static void
+stats_phys(struct stats_out *o)
+{
+	struct phy *phy;
+	char labels[64];
+	unsigned int i;
+	uint64_t *val;
+
+	for (i = 0; i < ARRAY_SIZE(phy_metrics); i++) {
+		stats_family(o, phy_metrics[i].name, phy_metrics[i].type, phy_metrics[i].help);
+		vlist_for_each_element(&phy_list, phy, node) {
+			/* some are updated by reader threads */
+			val = (uint64_t *) ((char *) phy + phy_metrics[i].offset);
+			snprintf(labels, sizeof(labels), "phy=\"%s\"", phy_name(phy));
+			stats_value(o, phy_metrics[i].name, labels,
+				    __atomic_load_n(val, __ATOMIC_RELAXED));
+		}
+	}
+
+	stats_family(o, "phy_control_queued", "gauge", "Commands waiting for api_control");
+	vlist_for_each_element(&phy_list, phy, node) {
+		snprintf(labels, sizeof(labels), "phy=\"%s\"", phy_name(phy));
+		stats_value(o, "phy_control_queued", labels, phy->control_queued);
+	}
+}
+
+static void
+stats_client_labels(struct client *cl, char *buf, size_t len)
+{
+	char addr[INET6_ADDRSTRLEN] = "?";
+	struct sockaddr_storage sa;
+	socklen_t sl = sizeof(sa);
+	unsigned int port = 0;
+
+	if (!getpeername(cl->sfd.fd.fd, (struct sockaddr *) &sa, &sl)) {
+		if (sa.ss_family == AF_INET) {
+			struct sockaddr_in *in = (struct sockaddr_in *) &sa;
+
+			inet_ntop(AF_INET, &in->sin_addr, addr, sizeof(addr));
+			port = ntohs(in->sin_port);
+		} else if (sa.ss_family == AF_INET6) {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &sa;
+
+			inet_ntop(AF_INET6, &in6->sin6_addr, addr, sizeof(addr));
+			port = ntohs(in6->sin6_port);
+		}
+	}
+
+	snprintf(buf, len, "client=\"%s:%u\",proto=\"%s\"", addr, port,
+		 cl->compression ? "zstd" : cl->binary ? "binary" : "plain");
+}
+
+enum {
+	CLIENT_METRIC_BYTES,
+	CLIENT_METRIC_WRITES,
+	CLIENT_METRIC_DROPPED,
+	CLIENT_METRIC_BACKLOG,
+	__CLIENT_METRIC_MAX
+};
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+} client_metrics[__CLIENT_METRIC_MAX] = {
+	[CLIENT_METRIC_BYTES] = { "client_bytes_total", "counter", "Bytes written to the client" },
+	[CLIENT_METRIC_WRITES] = { "client_writes_total", "counter", "Batches written to the client" },
+	[CLIENT_METRIC_DROPPED] = { "client_dropped_total", "counter",
+				    "Lines dropped for the slow client" },
+	[CLIENT_METRIC_BACKLOG] = { "client_backlog_bytes", "gauge",
+				    "Output held back for the client" },
+};
+
+struct stats_client_arg {
+	struct stats_out *o;
+	unsigned int metric;
+};
+
+static void
+stats_client_cb(struct client *cl, void *arg)
+{
+	struct stats_client_arg *a = arg;
+	char labels[128];
+	uint64_t val;
+
+	switch (a->metric) {
+	case CLIENT_METRIC_BYTES:
+		val = cl->stats.bytes;
+		break;
+	case CLIENT_METRIC_WRITES:
+		val = cl->stats.writes;
+		break;
+	case CLIENT_METRIC_DROPPED:
+		val = cl->dropped;
+		break;
+	default:
+		val = ustream_pending_data(&cl->sfd.stream, true) + cl->batch_bytes +
+		      cl->queue_bytes;
+		break;
+	}
+
+	stats_client_labels(cl, labels, sizeof(labels));
+	stats_value(a->o, client_metrics[a->metric].name, labels, val);
+}
+
+static void
+stats_clients(struct stats_out *o)
+{
+	struct stats_client_arg arg = { .o = o };
+
+	for (arg.metric = 0; arg.metric < __CLIENT_METRIC_MAX; arg.metric++) {
+		stats_family(o, client_metrics[arg.metric].name, client_metrics[arg.metric].type,
+			     client_metrics[arg.metric].help);
+		rcd_client_for_each(stats_client_cb, &arg);
+	}
+}
+
+static void
+stats_write(struct stats_out *o)
+{
+	static const char * const flush_reasons[__RCD_ZSTD_FLUSH_MAX] = {
+		[RCD_ZSTD_FLUSH_FULL] = "full",
+		[RCD_ZSTD_FLUSH_TIMEOUT] = "timeout",
+		[RCD_ZSTD_FLUSH_EXPLICIT] = "explicit",
+	};
+	char labels[32];
+	unsigned int i;
+
+	stats_phys(o);
+	stats_clients(o);
+
+	stats_counter(o, "commands_total", "Commands received", rcd_stats.commands);
+	stats_counter(o, "command_errors_total", "Commands that failed", rcd_stats.command_errors);
+	stats_hist(o, "command_latency_us", "Time from receiving a command to its result",
+		   &rcd_stats.command_latency);
+	stats_hist(o, "client_write_bytes", "Size of the batches written to clients",
+		   &rcd_stats.client_write);
+
+	stats_counter(o, "zstd_in_bytes_total", "Bytes compressed", rcd_stats.zstd_in);
+	stats_counter(o, "zstd_out_bytes_total", "Compressed bytes", rcd_stats.zstd_out);
+	stats_family(o, "zstd_ratio", "gauge", "Compression ratio so far");
+	stats_name(o, "zstd_ratio", "", NULL);
+	fprintf(o->f, "%.3f\n", rcd_stats.zstd_out ?
+		(double) rcd_stats.zstd_in / rcd_stats.zstd_out : 0);
+	stats_family(o, "zstd_flushes_total", "counter", "Compression buffer flushes by reason");
+	for (i = 0; i < __RCD_ZSTD_FLUSH_MAX; i++) {
+		snprintf(labels, sizeof(labels), "reason=\"%s\"", flush_reasons[i]);
+		stats_value(o, "zstd_flushes_total", labels, rcd_stats.zstd_flush[i]);
+	}
+
+	stats_counter(o, "debugfs_monitor_lines_total", "Lines forwarded by debugfs monitors",
+		      rcd_stats.monitor_lines);
+	stats_counter(o, "debugfs_monitor_bytes_total", "Bytes read by debugfs monitors",
+		      rcd_stats.monitor_bytes);
+
+	stats_counter(o, "mqtt_published_total", "MQTT messages published",
+		      rcd_stats.mqtt_published);
+	stats_counter(o, "mqtt_publish_errors_total", "MQTT messages that failed to publish",
+		      rcd_stats.mqtt_errors);
+}
+
+static char *
+stats_format(bool prom, size_t *len)
+{
+	struct stats_out o = { .prom = prom };
+	char *buf;
+
+	o.f = open_memstream(&buf, len);
+	if (!o.f)
+		return NULL;
+
+	stats_write(&o);
+	if (fclose(o.f)) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+int rcd_stats_cmd(struct client *cl, struct phy *phy, char *args)
+{
+	size_t len;
+	char *buf;
+
+	buf = stats_format(false, &len);
+	if (!buf)
+		return ENOMEM;
+
+	client_send(cl, buf, len);
+	free(buf);
+
+	return 0;
+}
+
+static void
+metrics_conn_free(struct metrics_conn *c)
+{
+	ustream_free(&c->sfd.stream);
+	close(c->sfd.fd.fd);
+	free(c);
+}
+
+static void
+metrics_notify_read(struct ustream *s, int bytes)
+{
+	struct metrics_conn *c = container_of(s, struct metrics_conn, sfd.stream);
+	const char *status = "200 OK";
+	char *data, *body = NULL;
+	size_t len = 0;
+	int avail;
+
+	if (c->done)
+		return;
+
+	data = ustream_get_read_buf(s, &avail);
+	if (!data)
+		return;
+
+	if (!strstr(data, "\r\n\r\n") && !strstr(data, "\n\n")) {
+		if (avail < METRICS_REQUEST_MAX)
+			return;
+
+		status = "400 Bad Request";
+	} else if (strncmp(data, "GET ", 4) != 0) {
+		status = "405 Method Not Allowed";
+	} else {
+		body = stats_format(true, &len);
+		if (!body)
+			status = "500 Internal Server Error";
+	}
+
+	ustream_printf(s, "HTTP/1.0 %s\r\n"
+		       "Content-Type: text/plain; version=0.0.4\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Connection: close\r\n\r\n", status, len);
+	if (body)
+		ustream_write(s, body, len, false);
+	free(body);
+
+	/* closed from the state callback once everything is written */
+	c->done = true;
+	ustream_consume(s, avail);
+	ustream_state_change(s);
+}
+
+static void
+metrics_notify_write(struct ustream *s, int bytes)
+{
+	struct metrics_conn *c = container_of(s, struct metrics_conn, sfd.stream);
+
+	if (c->done && !ustream_pending_data(s, true))
+		ustream_state_change(s);
+}
+
+static void
+metrics_notify_state(struct ustream *s)
+{
+	struct metrics_conn *c = container_of(s, struct metrics_conn, sfd.stream);
+
+	if (s->eof || s->write_error || (c->done && !ustream_pending_data(s, true)))
+		metrics_conn_free(c);
+}
+
+static void
+metrics_accept_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct metrics_conn *c;
+	struct ustream *s;
+	int cfd;
+
+	while (1) {
+		cfd = accept(fd->fd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(cfd);
+			continue;
+		}
+
+		s = &c->sfd.stream;
+		s->notify_read = metrics_notify_read;
+		s->notify_write = metrics_notify_write;
+		s->notify_state = metrics_notify_state;
+		s->string_data = true;
+		ustream_fd_init(&c->sfd, cfd);
+	}
+}
+
+/* listen for Prometheus scrapes on [<address>:]<port>, IPv6 addresses in [] */
+int rcd_stats_init(const char *listen)
+{
+	char host[64] = "127.0.0.1", *sep;
+	const char *port = listen;
+	size_t len;
+
+	if (!listen || !*listen)
+		return 0;
+
+	sep = strrchr(listen, ':');
+	if (sep) {
+		port = sep + 1;
+		len = sep - listen;
+		if (len > 1 && listen[0] == '[' && listen[len - 1] == ']') {
+			listen++;
+			len -= 2;
+		}
+
+		if (!len || len >= sizeof(host))
+			return -1;
+
+		memcpy(host, listen, len);
+		host[len] = 0;
+	}
+
+	metrics_fd.fd = usock(USOCK_SERVER | USOCK_NONBLOCK | USOCK_TCP, host, port);
+	if (metrics_fd.fd < 0)
+		return -1;
+
+	metrics_fd.cb = metrics_accept_cb;
+	uloop_fd_add(&metrics_fd, ULOOP_READ);
+
+	return 0;
+}
@@ -7,7 +7,11 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include <zstd.h>
 
@@ -18,6 +22,69 @@ static ZSTD_CCtx *_ctx = NULL;
 
 static struct zstd_buf *default_buf;
 
+/*
+ * Stream compression runs in a worker thread with its own ZSTD_CCtx. Each
+ * zstd_buf collects its input in one of two blocks while the other one may
+ * be queued for or under compression. Compressed blocks are handed back to
+ * the uloop thread through an eventfd and passed to the buffer's flush
+ * callback there, in the order they were queued. Only if the previous block
+ * of a buffer is still being compressed when the next one fills up does
+ * the uloop thread have to wait for it.
+ */
+struct zstd_block {
+	struct list_head list;
+	struct zstd_buf *buf;
+	/* stream context of the buffer, NULL for a frame of its own */
+	ZSTD_CCtx *cctx;
+	/* the block ends the current frame */
+	bool end;
+	void *in;
+	size_t in_len;
+	void *out;
+	size_t out_size;
+	size_t out_len;
+	/* queued and not handed out yet, only used by the uloop thread */
+	bool busy;
+	/* compressed and waiting on the done list, protected by worker.lock */
+	bool done;
+};
+
+/*
+ * In streaming mode, a buffer keeps one frame open over many blocks and only
+ * flushes it (ZSTD_e_flush) at the end of a block, so the window carries over
+ * from one block to the next. The frame is ended at the first flush after
+ * resync_ms, or when a flush is requested explicitly. A client can only start
+ * to decode a stream at the beginning of a frame.
+ */
+struct zstd_stream {
+	ZSTD_CCtx *ctx;
+	unsigned int resync_ms;
+	uint64_t frame_start;
+	bool open;
+};
+
+/* room for the frame header and the block headers on top of the compress bound */
+#define ZSTD_STREAM_MARGIN	32
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t compressed;
+	struct list_head queue;
+	struct list_head done;
+	struct uloop_fd notify;
+	ZSTD_CCtx *ctx;
+	bool running;
+	bool stop;
+} worker = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.compressed = PTHREAD_COND_INITIALIZER,
+	.queue = LIST_HEAD_INIT(worker.queue),
+	.done = LIST_HEAD_INIT(worker.done),
+};
+
 static const char *EMSG_NODICT = "no dictionary provided";
 static const char *EMSG_LOADFAILED = "error loading dictionary";
 static const char *EMSG_NOCTX = "error creating zstd context";
@@ -36,6 +103,8 @@ __compress(void *data, size_t len, void *dst, size_t dstlen, size_t *complen)
 	if (ZSTD_isError(clen))
 		goto error;
 
+	rcd_stats.zstd_in += len;
+	rcd_stats.zstd_out += clen;
 	*complen = clen;
 	return 0;
 
@@ -185,40 +254,198 @@ load_dict(const char *path, int complvl)
 	return dict;
 }
 
+static uint64_t
+zstd_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
 static void
-zstd_compress_and_flush(struct zstd_buf *buf)
+zstd_block_compress(ZSTD_CCtx *ctx, struct zstd_block *blk)
 {
-	size_t remaining;
-	bool done;
-	ZSTD_inBuffer in;
-	ZSTD_outBuffer out;
+	ZSTD_inBuffer in = { blk->in, blk->in_len, 0 };
+	ZSTD_outBuffer out = { blk->out, blk->out_size, 0 };
+	size_t ret;
+
+	/* out_size is above the compress bound of the block, so this cannot run short */
+	if (!blk->cctx) {
+		ret = ZSTD_compress2(ctx, blk->out, blk->out_size, blk->in, blk->in_len);
+		if (ZSTD_isError(ret))
+			goto error;
+
+		blk->out_len = ret;
+		return;
+	}
 
-	if (buf->in.pos == 0)
-		goto done;
+	ret = ZSTD_compressStream2(blk->cctx, &out, &in, blk->end ? ZSTD_e_end : ZSTD_e_flush);
+	if (ZSTD_isError(ret))
+		goto error;
 
-	in.src = buf->in.buf;
-	in.size = buf->in.pos;
-	in.pos = 0;
+	blk->out_len = out.pos;
+	if (!ret)
+		return;
 
-	do {
-		out.dst = buf->out.buf;
-		out.size = buf->out.size;
-		out.pos = 0;
-
-		remaining = ZSTD_compressStream2(_ctx, &out, &in, ZSTD_e_end);
-		if (ZSTD_isError(remaining)) {
-			fprintf(stderr, "stream compression error: %s\n", ZSTD_getErrorName(remaining));
-			buf->in.pos = 0;
-			goto done;
+	fprintf(stderr, "stream compression error: output buffer too small\n");
+	return;
+
+error:
+	fprintf(stderr, "stream compression error: %s\n", ZSTD_getErrorName(ret));
+	blk->out_len = 0;
+}
+
+static void *
+zstd_worker(void *arg)
+{
+	struct zstd_block *blk;
+	bool notify;
+
+	pthread_mutex_lock(&worker.lock);
+	while (1) {
+		while (list_empty(&worker.queue) && !worker.stop)
+			pthread_cond_wait(&worker.queued, &worker.lock);
+
+		if (list_empty(&worker.queue))
+			break;
+
+		blk = list_first_entry(&worker.queue, struct zstd_block, list);
+		list_del(&blk->list);
+		pthread_mutex_unlock(&worker.lock);
+
+		zstd_block_compress(worker.ctx, blk);
+
+		pthread_mutex_lock(&worker.lock);
+		/* the uloop thread drains the whole list on each wakeup */
+		notify = list_empty(&worker.done);
+		list_add_tail(&blk->list, &worker.done);
+		blk->done = true;
+		pthread_cond_broadcast(&worker.compressed);
+
+		if (notify) {
+			uint64_t val = 1;
+
+			if (write(worker.notify.fd, &val, sizeof(val)) < 0)
+				continue;
+		}
+	}
+	pthread_mutex_unlock(&worker.lock);
+
+	return NULL;
+}
+
+/* hand compressed blocks to their buffers' flush callbacks */
+static void
+zstd_worker_deliver(void)
+{
+	struct zstd_block *blk;
+
+	while (1) {
+		pthread_mutex_lock(&worker.lock);
+		blk = NULL;
+		if (!list_empty(&worker.done)) {
+			blk = list_first_entry(&worker.done, struct zstd_block, list);
+			list_del(&blk->list);
+			blk->done = false;
 		}
+		pthread_mutex_unlock(&worker.lock);
+
+		if (!blk)
+			break;
+
+		/* the callback may free the buffer, so blk is not touched after it */
+		blk->busy = false;
+		rcd_stats.zstd_out += blk->out_len;
+		if (blk->out_len)
+			blk->buf->flush(blk->buf, blk->out, blk->out_len, blk->end);
+	}
+}
+
+static void
+zstd_worker_cb(struct uloop_fd *fd, unsigned int events)
+{
+	uint64_t val;
+
+	if (read(fd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return;
+
+	zstd_worker_deliver();
+}
+
+/* wait until blk is compressed, if deliver is false its output is dropped */
+static void
+zstd_block_wait(struct zstd_block *blk, bool deliver)
+{
+	if (!blk->busy)
+		return;
+
+	pthread_mutex_lock(&worker.lock);
+	while (!blk->done)
+		pthread_cond_wait(&worker.compressed, &worker.lock);
+
+	if (!deliver) {
+		list_del(&blk->list);
+		blk->done = false;
+		blk->busy = false;
+	}
+	pthread_mutex_unlock(&worker.lock);
+
+	/* the done list is in queue order, so this hands out blk last */
+	if (deliver)
+		zstd_worker_deliver();
+}
+
+static void
+zstd_compress_and_flush(struct zstd_buf *buf, enum rcd_zstd_flush reason)
+{
+	struct zstd_block *blk = buf->blocks[buf->cur];
+	struct zstd_block *next = buf->blocks[!buf->cur];
+	struct zstd_stream *st = buf->stream;
+	bool end = reason == RCD_ZSTD_FLUSH_EXPLICIT;
+
+	if (!st)
+		end = true;
+	else if (st->open && zstd_now_ms() - st->frame_start >= st->resync_ms)
+		end = true;
+
+	/* an open frame may have to be ended without any new input */
+	if (buf->in.pos == 0 && !(end && st && st->open))
+		goto done;
 
-		buf->flush(buf, out.dst, out.pos);
+	/* the other block is refilled next, so it has to be handed out first */
+	zstd_block_wait(next, true);
 
-		done = remaining == 0;
-	} while (!done);
+	rcd_stats.zstd_flush[reason]++;
+	rcd_stats.zstd_in += buf->in.pos;
+
+	if (st) {
+		if (!st->open)
+			st->frame_start = zstd_now_ms();
+		st->open = !end;
+	}
 
+	blk->cctx = st ? st->ctx : NULL;
+	blk->end = end;
+	blk->in_len = buf->in.pos;
+	buf->cur = !buf->cur;
+	buf->in.buf = next->in;
 	buf->in.pos = 0;
 
+	if (!worker.running) {
+		zstd_block_compress(_ctx, blk);
+		rcd_stats.zstd_out += blk->out_len;
+		if (blk->out_len)
+			buf->flush(buf, blk->out, blk->out_len, end);
+		goto done;
+	}
+
+	blk->busy = true;
+	pthread_mutex_lock(&worker.lock);
+	list_add_tail(&blk->list, &worker.queue);
+	pthread_cond_signal(&worker.queued);
+	pthread_mutex_unlock(&worker.lock);
+
 done:
 	reset_timeout(buf);
 }
@@ -244,7 +471,7 @@ zstd_read_fmt(struct zstd_buf *buf, const char *fmt, ...)
 	if (read < remaining)
 		goto ok;
 
-	zstd_compress_and_flush(buf);
+	zstd_compress_and_flush(buf, RCD_ZSTD_FLUSH_FULL);
 
 	va_start(va_args, fmt);
 	read = vsnprintf(buf->in.buf, buf->in.size, fmt, va_args);
@@ -266,36 +493,234 @@ ok:
 	return 0;
 }
 
+int
+zstd_buf_write(struct zstd_buf *buf, const void *data, size_t len)
+{
+	if (!buf)
+		buf = default_buf;
+
+	if (len > buf->in.size) {
+		fprintf(stderr, "discarding data of length %zu: cannot fit into buffer of size: %zu\n",
+		        len, buf->in.size);
+		return -1;
+	}
+
+	if (len > buf->in.size - buf->in.pos)
+		zstd_compress_and_flush(buf, RCD_ZSTD_FLUSH_FULL);
+
+	memcpy(buf->in.buf + buf->in.pos, data, len);
+	buf->in.pos += len;
+	if (!buf->timeout.pending)
+		reset_timeout(buf);
+
+	return 0;
+}
+
+void
+zstd_buf_flush(struct zstd_buf *buf)
+{
+	if (!buf)
+		buf = default_buf;
+
+	zstd_compress_and_flush(buf, RCD_ZSTD_FLUSH_EXPLICIT);
+	zstd_block_wait(buf->blocks[0], true);
+	zstd_block_wait(buf->blocks[1], true);
+}
+
 static inline void
 timeout_flush(struct uloop_timeout *t)
 {
 	struct zstd_buf *buf = container_of(t, struct zstd_buf, timeout);
-	zstd_compress_and_flush(buf);
+	zstd_compress_and_flush(buf, RCD_ZSTD_FLUSH_TIMEOUT);
 }
 
 int
 zstd_buf_init(struct zstd_buf *buf, size_t size, unsigned int timeout_ms, zstd_buf_flush_cb cb)
 {
+	struct zstd_block *blk;
+	size_t out_size = ZSTD_compressBound(size) + ZSTD_STREAM_MARGIN;
+	void *in, *out;
+	int i;
+
 	memset(buf, 0, sizeof(*buf));
 	INIT_LIST_HEAD(&buf->timeout.list);
 
-	buf->in.size = size;
-	buf->out.size = ZSTD_compressBound(size);
+	for (i = 0; i < 2; i++) {
+		blk = calloc_a(sizeof(*blk), &in, size, &out, out_size);
+		if (!blk)
+			goto free;
 
-	buf->in.buf = calloc_a(size, &buf->out.buf, buf->out.size);
-	if (!buf->in.buf)
-		return -ENOMEM;
+		blk->in = in;
+		blk->out = out;
+		blk->buf = buf;
+		blk->out_size = out_size;
+		buf->blocks[i] = blk;
+	}
 
+	buf->in.buf = buf->blocks[0]->in;
+	buf->in.size = size;
 	buf->timeout_ms = timeout_ms;
 	buf->timeout.cb = timeout_flush;
 	buf->flush = cb;
 	return 0;
+
+free:
+	free(buf->blocks[0]);
+	return -ENOMEM;
+}
+
+/* switch a freshly initialized buffer to streaming mode */
+static int
+zstd_buf_stream_init(struct zstd_buf *buf, unsigned int resync_ms)
+{
+	struct zstd_stream *st;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return -ENOMEM;
+
+	st->ctx = ZSTD_createCCtx();
+	if (!st->ctx) {
+		free(st);
+		return -ENOMEM;
+	}
+
+	ZSTD_CCtx_refCDict(st->ctx, _dict);
+	st->resync_ms = resync_ms;
+	buf->stream = st;
+
+	return 0;
+}
+
+/* set up a buffer with the same size, flush timeout and mode as the default one */
+int
+zstd_buf_init_default(struct zstd_buf *buf, zstd_buf_flush_cb cb)
+{
+	int err;
+
+	err = zstd_buf_init(buf, default_buf->in.size, default_buf->timeout_ms, cb);
+	if (err || !default_buf->stream)
+		return err;
+
+	err = zstd_buf_stream_init(buf, default_buf->stream->resync_ms);
+	if (err)
+		zstd_buf_free(buf);
+
+	return err;
+}
+
+/*
+ * Returns true if the next output of the buffer starts a new frame, i.e. a
+ * client can start to receive it, or can be sent a frame of its own.
+ */
+bool
+zstd_buf_at_frame_start(struct zstd_buf *buf)
+{
+	if (!buf)
+		buf = default_buf;
+
+	if (!buf->stream)
+		return true;
+
+	return !buf->stream->open && !buf->blocks[0]->busy && !buf->blocks[1]->busy;
+}
+
+bool
+zstd_streaming(void)
+{
+	return default_buf->stream != NULL;
+}
+
+void
+zstd_buf_free(struct zstd_buf *buf)
+{
+	int i;
+
+	uloop_timeout_cancel(&buf->timeout);
+
+	for (i = 0; i < 2; i++) {
+		if (!buf->blocks[i])
+			continue;
+
+		zstd_block_wait(buf->blocks[i], false);
+		free(buf->blocks[i]);
+		buf->blocks[i] = NULL;
+	}
+
+	if (buf->stream) {
+		ZSTD_freeCCtx(buf->stream->ctx);
+		free(buf->stream);
+		buf->stream = NULL;
+	}
 }
 
 static inline void
-default_flush(struct zstd_buf *buf, const void *data, size_t len)
+default_flush(struct zstd_buf *buf, const void *data, size_t len, bool end)
 {
 	rcd_client_write(data, len, true);
+
+	/* clients waiting for the next frame can join the stream now */
+	if (end && buf->stream)
+		rcd_client_zstd_resync();
+}
+
+static int
+zstd_worker_start(void)
+{
+	sigset_t set, old;
+
+	worker.ctx = ZSTD_createCCtx();
+	if (!worker.ctx)
+		return -1;
+
+	ZSTD_CCtx_refCDict(worker.ctx, _dict);
+
+	worker.notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker.notify.fd < 0)
+		goto free;
+
+	/* signals are handled by the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	if (pthread_create(&worker.thread, NULL, zstd_worker, NULL)) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		goto close;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	worker.notify.cb = zstd_worker_cb;
+	uloop_fd_add(&worker.notify, ULOOP_READ);
+	worker.running = true;
+
+	return 0;
+
+close:
+	close(worker.notify.fd);
+free:
+	ZSTD_freeCCtx(worker.ctx);
+	worker.ctx = NULL;
+	return -1;
+}
+
+static void
+zstd_worker_stop(void)
+{
+	if (!worker.running)
+		return;
+
+	pthread_mutex_lock(&worker.lock);
+	worker.stop = true;
+	pthread_cond_signal(&worker.queued);
+	pthread_mutex_unlock(&worker.lock);
+	pthread_join(worker.thread, NULL);
+
+	/* hand out whatever was still queued */
+	zstd_worker_deliver();
+
+	uloop_fd_delete(&worker.notify);
+	close(worker.notify.fd);
+	ZSTD_freeCCtx(worker.ctx);
+	worker.running = false;
 }
 
 int
@@ -327,8 +752,18 @@ zstd_init(struct zstd_buf *buf, const struct zstd_opts *o)
 		goto free;
 	}
 
+	if (o->resync_ms && zstd_buf_stream_init(buf, o->resync_ms)) {
+		zstd_buf_free(buf);
+		errmsg = EMSG_NOCTX;
+		goto free;
+	}
+
 	default_buf = buf;
 
+	if (zstd_worker_start())
+		fprintf(stderr, "WARNING: could not start the compression thread, "
+			"compressing on the main thread\n");
+
 	return 0;
 free:
 	ZSTD_freeCDict(_dict);
@@ -341,9 +776,10 @@ void
 zstd_stop(bool flush)
 {
 	if (flush)
-		zstd_compress_and_flush(default_buf);
+		zstd_buf_flush(default_buf);
 
-	free(default_buf->in.buf);
+	zstd_worker_stop();
+	zstd_buf_free(default_buf);
 	ZSTD_freeCDict(_dict);
 }
 